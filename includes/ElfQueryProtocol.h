@@ -0,0 +1,50 @@
+﻿#pragma once
+
+#include <cstdint>
+
+// Бинарный протокол ElfReaderServer поверх AF_UNIX SOCK_STREAM.
+// Запрос: RequestHeader + payload, ответ: ResponseHeader + payload.
+// Числа в little-endian, строка: uint16 длина + байты UTF-8 без завершающего нуля.
+// Каждый запрос начинается с пути к ELF, в одном соединении можно отправлять запросы подряд.
+namespace elfquery
+{
+	constexpr uint32_t PROTOCOL_MAGIC = 0x51464C45; // "ELFQ"
+	constexpr uint16_t PROTOCOL_VERSION = 1;
+	constexpr uint32_t MAX_PAYLOAD = 16 * 1024 * 1024;
+
+	enum class Opcode : uint8_t
+	{
+		Ping = 0,				// -> пусто
+		MemorySizes = 1,		// path -> 7 x int32: text, data, bss, flash, ram, binSize, dec
+		LineRanges = 2,			// path, file, u32 first_line, u32 last_line -> u32 count, count x { u64 low, u64 high, u32 line, u32 is_stmt }, по (line, low)
+		AddressLookup = 3,		// path, u32 count, count x u64 -> count x { u32 line (0 - нет), file, function, u64 function_address }
+		ResolveBreakpoint = 4,	// path, file, u32 line -> u32 actual_line, u32 count, count x u64
+		SymbolLookup = 5,		// path, name -> u64 address, u64 size, u8 type
+	};
+
+	enum class Status : uint32_t
+	{
+		Ok = 0,
+		NotFound = 1,
+		BadRequest = 2,
+		LoadFailed = 3,
+		InternalError = 4,
+	};
+
+#pragma pack(push, 1)
+	struct RequestHeader
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint8_t opcode;
+		uint8_t reserved;
+		uint32_t payloadSize;
+	};
+
+	struct ResponseHeader
+	{
+		uint32_t status;
+		uint32_t payloadSize;
+	};
+#pragma pack(pop)
+}
@@ -2,8 +2,12 @@
 #define NOMINMAX
 
 #include <stdexcept>
+#include <atomic>
 #include <filesystem>
+#include <functional>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 #include <NinjaCallback.h>
 
@@ -15,7 +19,9 @@
 #   define API_ELF
 #endif
 
-#ifdef ELFREADER_EXPORTS
+#if defined(ELFREADER_STATIC)
+#   define ELFREADER_API
+#elif defined(ELFREADER_EXPORTS)
 #   define ELFREADER_API __declspec(dllexport)
 #else
 #   define ELFREADER_API __declspec(dllimport)
@@ -70,11 +76,141 @@ namespace elfreader
 		uint32_t view;
 	};
 
+	constexpr uint32_t NO_FILE = UINT32_MAX;
+	constexpr uint32_t NO_FUNCTION = UINT32_MAX;
+
+	// Коды возврата C API:
+	//   0                  успех
+	//   1                  ElfAnalyze: исключение; OpenElfSession: ELF не прочитан; дифф, размеры, адреса:
+	//                      неверные аргументы; шаги: pc вне функций; CancelRequest: запрос уже завершён
+	//   2                  GetSymbols и функции с результатом в памяти: ошибка выделения памяти;
+	//                      ElfAnalyze: неизвестное исключение; *Async, шаги: неверные аргументы
+	//   3                  исключение
+	//   -4                 неизвестное исключение
+	//   REQUEST_CANCELLED  запрос отменён через DecodeControl::cancel или CancelRequest,
+	//                      значение не совпадает ни с одним кодом синхронных функций
+	constexpr int REQUEST_CANCELLED = -5;
+
+	// Отмена и прогресс проверяются на границах unit в .debug_line
+	struct DecodeControl
+	{
+		const std::atomic<bool>* cancel = nullptr;
+		//доля обработанных байт .debug_line, от 0 до 1
+		std::function<void(double)> progress;
+	};
+
+	struct LineRow;
+	struct SymbolInfo;
+	// определены в src/DecodedImage.h, для клиентов DLL непрозрачны
+	struct DecodedImage;
+	struct ElfSession;
+
+	enum StepKind
+	{
+		//остановка на первом сработавшем в том же кадре: операторы и выходы функции из GetFunctionSteps
+		//с ключом строки, отличным от CStepInfo::lineKey, или адрес возврата
+		StepStatements,
+		//pc в эпилоге, отмеченном DW_LNS_set_epilogue_begin, следующая остановка после возврата
+		StepFunctionExit
+	};
+
+	typedef struct CFileFootprint {
+		char* file;
+		uint64_t bytes;
+	} CFileFootprint;
+
+	typedef struct CFunctionFootprint {
+		char* name;
+		uint64_t address;
+		//размер из .symtab
+		uint64_t size;
+		//байты, покрытые таблицей строк
+		uint64_t lineBytes;
+	} CFunctionFootprint;
+
+	typedef struct CFootprint {
+		//по убыванию bytes
+		CFileFootprint* files;
+		size_t fileCount;
+		//по убыванию size
+		CFunctionFootprint* functions;
+		size_t functionCount;
+		uint64_t totalBytes;
+	} CFootprint;
+
+	typedef struct CResolvedAddress {
+		//индекс для GetSessionFile, NO_FILE - адрес вне таблицы строк
+		uint32_t file;
+		uint32_t line;
+		//индекс для GetSessionFunction, NO_FUNCTION - адрес вне функций .symtab
+		uint32_t function;
+	} CResolvedAddress;
+
+	typedef struct CLineHits {
+		uint32_t file;
+		uint32_t line;
+		uint64_t hits;
+	} CLineHits;
+
+	typedef struct CStepInfo {
+		//следующий по адресу оператор с другой строкой, 0 - нет. Кандидат для StepStatements,
+		//а не место остановки: из циклов и ветвлений управление уходит к другим операторам
+		uint64_t fallThrough;
+		uint64_t functionStart;
+		uint64_t functionEnd;
+		//ключ строки оператора, которому принадлежит pc, UINT32_MAX - pc до первого оператора
+		uint32_t lineKey;
+		int kind;
+	} CStepInfo;
+
+	typedef struct CBreakpointRequest {
+		const char* file;
+		uint32_t line;
+	} CBreakpointRequest;
+
+	enum BreakpointState
+	{
+		BreakpointUnchanged,
+		BreakpointMoved,
+		//в новой сборке у строки нет кода
+		BreakpointRemoved,
+		//в старой сборке у строки не было кода
+		BreakpointUnknown
+	};
+
+	typedef struct CBreakpointMove {
+		uint64_t oldAddress;
+		uint64_t newAddress;
+		int state;
+	} CBreakpointMove;
+
+	typedef struct CSourceLine {
+		char* file;
+		uint32_t line;
+	} CSourceLine;
+
+	typedef struct CBreakpointDiff {
+		//в порядке запросов
+		CBreakpointMove* moves;
+		size_t moveCount;
+		//все строки, у которых был код в старой сборке и нет в новой
+		CSourceLine* removed;
+		size_t removedCount;
+		//файлы, у которых изменился набор строк или смещения кода внутри файла
+		char** changedUnits;
+		size_t changedCount;
+	} CBreakpointDiff;
+
 	class ELFREADER_API  ElfReader {
 	public:
 		ElfReader(build_callback cb) : m_cb(cb) {}
 		MemorySizes* Analyze(const std::filesystem::path& elfPath);
-		int ParseDebugLine(const std::filesystem::path& elfPath, std::vector<LineEntry>& out_lines, std::vector<std::string>& filteredName, int only_stmt, uint64_t& line);
+		int ParseDebugLine(const std::filesystem::path& elfPath, std::vector<LineEntry>& out_lines, std::vector<std::string>& filteredName, int only_stmt, uint64_t& line,
+			const DecodeControl* control = nullptr);
+		int CollectSymbols(const wchar_t* path, std::vector<std::string>& filter, int only_stmt,
+			CLineEntry** outArray, size_t* outCount, uint64_t& line,
+			const DecodeControl* control = nullptr);
+		int Decode(const std::filesystem::path& elfPath, DecodedImage& image);
 
 		int GetSymbols(const wchar_t* path, const wchar_t** filters, size_t filterCount,
 			callback::build_callback cb,
@@ -85,10 +221,21 @@ namespace elfreader
 			ELFIO::elfio& reader,
 			const std::string& funcName,
 			const std::vector<LineEntry>& lines);
+
+		static std::vector<std::string> ConvertFilters(const wchar_t** filters, size_t filterCount);
+		static std::string ToLowerAscii(std::string value);
+		//строка в памяти std::malloc для передачи через C API
+		static char* CopyString(const std::string& value);
+		static std::string ExtractFilename(const std::string& path);
 	private:
 		build_callback m_cb;
 
 		static MemorySizes* AllocateMemorySizes();
+		static void ComputeMemorySizes(const ELFIO::elfio& reader, MemorySizes& mem);
+		static bool DecodeLineProgram(const char* data, size_t size, std::vector<std::string>& files, std::vector<LineRow>& rows,
+			const DecodeControl* control = nullptr);
+		static void ReadSymbols(const ELFIO::elfio& reader, std::vector<SymbolInfo>& symbols);
+		static void ReadCodeRanges(const ELFIO::elfio& reader, std::vector<std::pair<uint64_t, uint64_t>>& ranges);
 
 		static bool FiltredResult(std::vector<std::string>& filteredName, const std::string& name);
 		static void ReadLineHeader(const char* data, uint8_t& value, const size_t& size, size_t& offset);
@@ -96,7 +243,6 @@ namespace elfreader
 		static int64_t ReadSleb(const char* data, const size_t size, size_t& offset);
 		static uint32_t ReadU32(const char* data, const size_t size, size_t& offset);
 		static uint64_t ReadAddrBytes(const char* data, size_t size, size_t& offset, size_t n);
-		static std::string ExtractFilename(const std::string& path);
 		static std::string ToHexAddr(uint64_t value);
 
 	};
@@ -116,4 +262,93 @@ namespace elfreader
 
 		ELFREADER_API void API_ELF DeleteMemory(MemorySizes* memory);
 	}
+
+	extern "C" {
+		typedef void(__stdcall* progress_callback)(uint64_t request, double fraction);
+		typedef void(__stdcall* symbols_completion)(uint64_t request, int status, CLineEntry* arr, size_t count, uint64_t line);
+		typedef void(__stdcall* analyze_completion)(uint64_t request, int status, MemorySizes* memory);
+
+		// Запросы выполняются в пуле потоков библиотеки, callback-и вызываются из рабочего потока.
+		// Новый запрос отменяет ещё не завершённые запросы того же вида к тому же файлу с теми же
+		// параметрами (для GetSymbolsAsync - набор фильтров без учёта регистра и порядка и only_stmt).
+		// status как у синхронных функций или REQUEST_CANCELLED; результат освобождает получатель
+		// через FreeSymbols / DeleteMemory.
+		// Первый асинхронный запрос закрепляет DLL в процессе: FreeLibrary её больше не выгружает.
+		ELFREADER_API int API_ELF GetSymbolsAsync(const wchar_t** filters, size_t filterCount,
+			callback::build_callback cb, const wchar_t* path, int only_stmt,
+			progress_callback progress, symbols_completion done, uint64_t* request);
+
+		ELFREADER_API int API_ELF ElfAnalyzeAsync(const wchar_t* path, callback::build_callback cb,
+			analyze_completion done, uint64_t* request);
+
+		// 0 - отмена принята, 1 - запрос уже завершён или не существует
+		ELFREADER_API int API_ELF CancelRequest(uint64_t request);
+	}
+
+	extern "C" {
+
+		ELFREADER_API int API_ELF OpenElfSession(const wchar_t* path, callback::build_callback cb, ElfSession** session);
+
+		ELFREADER_API void API_ELF CloseElfSession(ElfSession* session);
+
+		// Адрес строки - наименьший адрес is_stmt, сравнение имён файлов без учёта регистра.
+		ELFREADER_API int API_ELF DiffBreakpoints(const ElfSession* oldSession, const ElfSession* newSession,
+			const CBreakpointRequest* requests, size_t count,
+			callback::build_callback cb, CBreakpointDiff** diff);
+
+		ELFREADER_API int API_ELF DiffBreakpointFiles(const wchar_t* oldPath, const wchar_t* newPath,
+			const CBreakpointRequest* requests, size_t count,
+			callback::build_callback cb, CBreakpointDiff** diff);
+
+		ELFREADER_API void API_ELF FreeBreakpointDiff(CBreakpointDiff* diff);
+	}
+
+	extern "C" {
+
+		// Строит таблицу шагов заранее, чтобы первый шаг отладчика не ждал её построения.
+		// IDE вызывает при подключении к цели; без вызова таблица строится при первом шаге
+		ELFREADER_API int API_ELF PrepareStepTable(ElfSession* session);
+
+		// Шаг "next" из pc, поиск за O(log n). Таблица строк не описывает переходы, поэтому одного
+		// адреса остановки нет: для StepStatements отладчик ставит временные точки на все адреса
+		// stmts и exits из GetFunctionSteps с ключом, отличным от info->lineKey, и на адрес возврата.
+		// 1 - pc вне функций .symtab
+		ELFREADER_API int API_ELF NextStopAddress(ElfSession* session, uint64_t pc, CStepInfo* info);
+
+		// Указатели на таблицу шагов функции, содержащей pc, действительны до CloseElfSession.
+		// stmtKeys и exitKeys - ключи строк, равные у адресов одной строки (file, line) функции.
+		// exits - начала эпилогов по DW_LNS_set_epilogue_begin. GCC эпилог не отмечает, тогда exits -
+		// только оценка (участки последней строки функции) и могут не совпадать с настоящими выходами
+		ELFREADER_API int API_ELF GetFunctionSteps(ElfSession* session, uint64_t pc,
+			const uint64_t** stmts, const uint32_t** stmtKeys, size_t* stmtCount,
+			const uint64_t** exits, const uint32_t** exitKeys, size_t* exitCount);
+	}
+
+	extern "C" {
+
+		// Байты кода по файлам и функциям: диапазоны между соседними строками последовательности,
+		// пересечённые с диапазонами функций .symtab. topN = 0 - без ограничения.
+		ELFREADER_API int API_ELF ElfFootprint(const wchar_t* path, callback::build_callback cb, size_t topN, CFootprint** footprint);
+
+		ELFREADER_API int API_ELF SessionFootprint(const ElfSession* session, callback::build_callback cb, size_t topN, CFootprint** footprint);
+
+		ELFREADER_API void API_ELF FreeFootprint(CFootprint* footprint);
+	}
+
+	extern "C" {
+
+		ELFREADER_API void API_ELF GetSessionCounts(const ElfSession* session, size_t* fileCount, size_t* functionCount);
+
+		ELFREADER_API const char* API_ELF GetSessionFile(const ElfSession* session, uint32_t file);
+
+		ELFREADER_API const char* API_ELF GetSessionFunction(const ElfSession* session, uint32_t function, uint64_t* address, uint64_t* size);
+
+		// Адреса сортируются поразрядно и разрешаются одним проходом слиянием по строкам и функциям.
+		// out - массив из count элементов в порядке addresses. functionHits (размер functionCount)
+		// и lineHits необязательны, счётчики functionHits накапливаются. threads = 0 - по числу ядер.
+		ELFREADER_API int API_ELF ResolveAddresses(const ElfSession* session, const uint64_t* addresses, size_t count,
+			CResolvedAddress* out, uint64_t* functionHits, CLineHits** lineHits, size_t* lineHitCount, uint32_t threads);
+
+		ELFREADER_API void API_ELF FreeLineHits(CLineHits* hits);
+	}
 }
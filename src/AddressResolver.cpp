@@ -0,0 +1,249 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <algorithm>
+#include <bit>
+#include <exception>
+#include <thread>
+
+
+namespace elfreader
+{
+	// минимальный размер части входа на поток, меньшие части не окупают запуск потока
+	constexpr size_t MIN_ADDRESSES_PER_THREAD = 1 << 16;
+
+	constexpr int RADIX_BITS = 11;
+	constexpr size_t RADIX_BUCKETS = size_t(1) << RADIX_BITS;
+
+	// LSD radix sort значений (смещение адреса << 32) | индекс, только по keyBits разрядам смещения.
+	// Гистограммы всех проходов собираются одним чтением входа.
+	static void RadixSort(std::vector<uint64_t>& items, std::vector<uint64_t>& buffer, int keyBits)
+	{
+		int passes = (keyBits + RADIX_BITS - 1) / RADIX_BITS;
+		if (passes == 0) return;
+
+		std::vector<size_t> offsets(passes * RADIX_BUCKETS);
+		for (auto item : items) {
+			uint64_t key = item >> 32;
+			for (int p = 0; p < passes; ++p)
+				++offsets[p * RADIX_BUCKETS + ((key >> (p * RADIX_BITS)) & (RADIX_BUCKETS - 1))];
+		}
+
+		buffer.resize(items.size());
+		for (int p = 0; p < passes; ++p)
+		{
+			size_t* offset = &offsets[p * RADIX_BUCKETS];
+			size_t sum = 0;
+			for (size_t bucket = 0; bucket < RADIX_BUCKETS; ++bucket) {
+				auto count = offset[bucket];
+				offset[bucket] = sum;
+				sum += count;
+			}
+
+			int shift = 32 + p * RADIX_BITS;
+			for (auto item : items) buffer[offset[(item >> shift) & (RADIX_BUCKETS - 1)]++] = item;
+			items.swap(buffer);
+		}
+	}
+
+	// Курсоры по rows и functions, адреса подаются по возрастанию, поэтому курсоры только растут
+	class MergeCursor
+	{
+	public:
+		MergeCursor(const DecodedImage& image, std::vector<uint64_t>* rowHits, std::vector<uint64_t>* functionHits)
+			: m_image(image), m_rowHits(rowHits), m_functionHits(functionHits) {}
+
+		CResolvedAddress Resolve(uint64_t address)
+		{
+			const auto& rows = m_image.rows;
+			const auto& functions = m_image.functions;
+			CResolvedAddress result{ NO_FILE, 0, NO_FUNCTION };
+
+			while (m_row < rows.size() && rows[m_row].address <= address) ++m_row;
+			if (m_row > 0 && !rows[m_row - 1].end_sequence) {
+				result.file = rows[m_row - 1].file;
+				result.line = rows[m_row - 1].line;
+				if (m_rowHits) ++(*m_rowHits)[m_row - 1];
+			}
+
+			while (m_function < functions.size() && m_image.symbols[functions[m_function]].address <= address) ++m_function;
+			if (m_function > 0) {
+				const auto& sym = m_image.symbols[functions[m_function - 1]];
+				if (address < sym.address + sym.size) {
+					result.function = static_cast<uint32_t>(m_function - 1);
+					if (m_functionHits) ++(*m_functionHits)[m_function - 1];
+				}
+			}
+			return result;
+		}
+
+	private:
+		const DecodedImage& m_image;
+		std::vector<uint64_t>* m_rowHits;
+		std::vector<uint64_t>* m_functionHits;
+		size_t m_row = 0;
+		size_t m_function = 0;
+	};
+
+	// индекс адреса внутри среза хранится в 32 разрядах
+	constexpr size_t MAX_ADDRESSES_PER_SLICE = UINT32_MAX;
+
+	static void ResolveSlice(const DecodedImage& image, const uint64_t* addresses, size_t begin, size_t end,
+		CResolvedAddress* out, std::vector<uint64_t>* rowHits, std::vector<uint64_t>* functionHits)
+	{
+		MergeCursor cursor(image, rowHits, functionHits);
+		auto [low, high] = std::minmax_element(addresses + begin, addresses + end);
+		uint64_t base = *low;
+		uint64_t range = *high - base;
+
+		if (range <= UINT32_MAX)
+		{
+			// смещение и индекс в одном 8-байтном значении, сортировка вдвое меньшего объёма
+			std::vector<uint64_t> items(end - begin);
+			for (size_t i = begin; i < end; ++i) items[i - begin] = ((addresses[i] - base) << 32) | (i - begin);
+			std::vector<uint64_t> buffer;
+			RadixSort(items, buffer, std::bit_width(range));
+
+			for (auto item : items)
+				out[begin + (item & UINT32_MAX)] = cursor.Resolve(base + (item >> 32));
+		}
+		else
+		{
+			std::vector<std::pair<uint64_t, uint32_t>> items(end - begin);
+			for (size_t i = begin; i < end; ++i) items[i - begin] = { addresses[i], static_cast<uint32_t>(i - begin) };
+			std::ranges::sort(items);
+
+			for (const auto& [address, index] : items)
+				out[begin + index] = cursor.Resolve(address);
+		}
+	}
+
+	static void ResolveChunk(const DecodedImage& image, const uint64_t* addresses, size_t begin, size_t end,
+		CResolvedAddress* out, std::vector<uint64_t>* rowHits, std::vector<uint64_t>* functionHits)
+	{
+		// часть потока может превышать 2^32 адресов (threads = 1 на большой трассе), сортируем её срезами
+		for (size_t slice = begin; slice < end; slice += std::min(end - slice, MAX_ADDRESSES_PER_SLICE))
+			ResolveSlice(image, addresses, slice, slice + std::min(end - slice, MAX_ADDRESSES_PER_SLICE), out, rowHits, functionHits);
+	}
+
+	static CLineHits* CollectLineHits(const DecodedImage& image, const std::vector<uint64_t>& rowHits, size_t& count)
+	{
+		std::vector<CLineHits> hits;
+		for (size_t i = 0; i < rowHits.size(); ++i)
+			if (rowHits[i] > 0) hits.push_back({ image.rows[i].file, image.rows[i].line, rowHits[i] });
+
+		// несколько строк таблицы могут описывать одну строку исходника
+		std::ranges::sort(hits, [](const CLineHits& a, const CLineHits& b) {
+			if (a.file != b.file) return a.file < b.file;
+			return a.line < b.line;
+			});
+		size_t n = 0;
+		for (const auto& hit : hits) {
+			if (n > 0 && hits[n - 1].file == hit.file && hits[n - 1].line == hit.line) hits[n - 1].hits += hit.hits;
+			else hits[n++] = hit;
+		}
+		hits.resize(n);
+		std::ranges::stable_sort(hits, std::greater<>(), &CLineHits::hits);
+
+		count = hits.size();
+		auto result = static_cast<CLineHits*>(std::malloc(sizeof(CLineHits) * std::max<size_t>(hits.size(), 1)));
+		if (result) std::ranges::copy(hits, result);
+		return result;
+	}
+
+	extern "C" {
+
+		void API_ELF GetSessionCounts(const ElfSession* session, size_t* fileCount, size_t* functionCount)
+		{
+			if (fileCount) *fileCount = session ? session->image.files.size() : 0;
+			if (functionCount) *functionCount = session ? session->image.functions.size() : 0;
+		}
+
+		const char* API_ELF GetSessionFile(const ElfSession* session, uint32_t file)
+		{
+			if (!session || file >= session->image.files.size()) return nullptr;
+			return session->image.files[file].c_str();
+		}
+
+		const char* API_ELF GetSessionFunction(const ElfSession* session, uint32_t function, uint64_t* address, uint64_t* size)
+		{
+			if (!session || function >= session->image.functions.size()) return nullptr;
+			const auto& sym = session->image.symbols[session->image.functions[function]];
+			if (address) *address = sym.address;
+			if (size) *size = sym.size;
+			return sym.name.c_str();
+		}
+
+		int API_ELF ResolveAddresses(const ElfSession* session, const uint64_t* addresses, size_t count,
+			CResolvedAddress* out, uint64_t* functionHits, CLineHits** lineHits, size_t* lineHitCount, uint32_t threads)
+		{
+			if (lineHits) *lineHits = nullptr;
+			if (lineHitCount) *lineHitCount = 0;
+			if (!session || (count > 0 && (!addresses || !out)) || (lineHits && !lineHitCount)) return 1;
+
+			try
+			{
+				const auto& image = session->image;
+
+				size_t workers = threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads;
+				workers = std::clamp<size_t>(count / MIN_ADDRESSES_PER_THREAD, 1, workers);
+				size_t chunk = (count + workers - 1) / workers;
+
+				std::vector<std::vector<uint64_t>> rowHits(lineHits ? workers : 0, std::vector<uint64_t>(image.rows.size()));
+				std::vector<std::vector<uint64_t>> funcHits(functionHits ? workers : 0, std::vector<uint64_t>(image.functions.size()));
+				std::vector<std::exception_ptr> errors(workers);
+
+				auto run = [&](size_t w) {
+					try
+					{
+						size_t begin = std::min(count, w * chunk);
+						size_t end = std::min(count, begin + chunk);
+						ResolveChunk(image, addresses, begin, end, out,
+							lineHits ? &rowHits[w] : nullptr, functionHits ? &funcHits[w] : nullptr);
+					}
+					catch (...)
+					{
+						errors[w] = std::current_exception();
+					}
+					};
+
+				std::vector<std::thread> pool;
+				for (size_t w = 1; w < workers; ++w) pool.emplace_back(run, w);
+				run(0);
+				for (auto& t : pool) t.join();
+				for (auto& error : errors)
+					if (error) std::rethrow_exception(error);
+
+				if (functionHits)
+					for (const auto& hits : funcHits)
+						for (size_t i = 0; i < hits.size(); ++i) functionHits[i] += hits[i];
+
+				if (lineHits)
+				{
+					for (size_t w = 1; w < workers; ++w)
+						for (size_t i = 0; i < image.rows.size(); ++i) rowHits[0][i] += rowHits[w][i];
+
+					*lineHits = CollectLineHits(image, rowHits[0], *lineHitCount);
+					if (!*lineHits)
+					{
+						*lineHitCount = 0;
+						return 2;
+					}
+				}
+				return 0;
+			}
+			catch (const std::exception&)
+			{
+				return 3;
+			}
+			catch (...)
+			{
+				return -4;
+			}
+		}
+
+		void API_ELF FreeLineHits(CLineHits* hits)
+		{
+			if (hits) std::free(hits);
+		}
+	}
+}
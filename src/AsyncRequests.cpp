@@ -0,0 +1,233 @@
+﻿#include <ElfReader.h>
+#include <Windows.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cwctype>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+
+namespace elfreader
+{
+	// Пул потоков для асинхронных запросов. Запрос с тем же ключом (вид + файл)
+	// отменяет предыдущие, отменённые запросы снимаются с очереди без декодирования.
+	class RequestPool
+	{
+	public:
+		using Work = std::function<void(uint64_t id, const std::atomic<bool>& cancelled)>;
+
+		static RequestPool& Instance()
+		{
+			// не разрушается при выгрузке DLL, рабочие потоки нельзя ждать под loader lock;
+			// вместо этого конструктор закрепляет модуль в процессе, см. RequestPool()
+			static auto* pool = new RequestPool(std::max(1u, std::thread::hardware_concurrency() / 2));
+			return *pool;
+		}
+
+		uint64_t Submit(std::wstring key, Work work)
+		{
+			auto request = std::make_shared<Request>();
+			request->key = std::move(key);
+			request->work = std::move(work);
+			{
+				std::lock_guard lock(m_mutex);
+				request->id = m_nextId++;
+				for (auto& [id, active] : m_active)
+					if (active->key == request->key) active->cancelled = true;
+				m_active.emplace(request->id, request);
+				m_queue.push_back(request);
+			}
+			m_wake.notify_one();
+			return request->id;
+		}
+
+		bool Cancel(uint64_t id)
+		{
+			std::lock_guard lock(m_mutex);
+			auto it = m_active.find(id);
+			if (it == m_active.end()) return false;
+			it->second->cancelled = true;
+			return true;
+		}
+
+	private:
+		struct Request
+		{
+			uint64_t id = 0;
+			std::wstring key;
+			std::atomic<bool> cancelled{ false };
+			Work work;
+		};
+
+		explicit RequestPool(unsigned threads)
+		{
+			// Рабочие потоки отсоединены и живут до конца процесса. Чтобы FreeLibrary при
+			// незавершённых запросах не выгрузил код, который они исполняют, DLL закрепляется:
+			// после первого асинхронного запроса она остаётся загруженной до завершения процесса.
+			HMODULE module = nullptr;
+			GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+				reinterpret_cast<LPCWSTR>(&RequestPool::Instance), &module);
+
+			for (unsigned i = 0; i < threads; ++i)
+				std::thread(&RequestPool::Run, this).detach();
+		}
+
+		void Run()
+		{
+			for (;;)
+			{
+				std::shared_ptr<Request> request;
+				{
+					std::unique_lock lock(m_mutex);
+					m_wake.wait(lock, [&] { return !m_queue.empty(); });
+					request = std::move(m_queue.front());
+					m_queue.pop_front();
+				}
+
+				request->work(request->id, request->cancelled);
+
+				std::lock_guard lock(m_mutex);
+				m_active.erase(request->id);
+			}
+		}
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::deque<std::shared_ptr<Request>> m_queue;
+		std::unordered_map<uint64_t, std::shared_ptr<Request>> m_active;
+		uint64_t m_nextId = 1;
+	};
+
+	// Ключ включает параметры запроса: отменяются только устаревшие запросы с тем же результатом,
+	// а не независимые запросы к тому же файлу
+	static std::wstring RequestKey(const wchar_t* kind, const wchar_t* path, const std::wstring& query = {})
+	{
+		std::error_code ec;
+		auto key = std::filesystem::weakly_canonical(path, ec).wstring();
+		if (ec) key = path;
+		std::ranges::transform(key, key.begin(), [](const wchar_t c) {return static_cast<wchar_t>(std::towlower(c)); });
+		return kind + key + L'\n' + query;
+	}
+
+	// Фильтры сравниваются без учёта регистра и порядка, как в ElfReader::FiltredResult
+	static std::wstring SymbolsQuery(std::vector<std::string> filter, int only_stmt)
+	{
+		for (auto& name : filter) name = ElfReader::ToLowerAscii(std::move(name));
+		std::ranges::sort(filter);
+		filter.erase(std::unique(filter.begin(), filter.end()), filter.end());
+
+		std::wstring query = only_stmt ? L"stmt" : L"all";
+		for (const auto& name : filter) {
+			query += L'\n';
+			query.append(name.begin(), name.end());
+		}
+		return query;
+	}
+
+	static int ReportException(const std::exception& ex, callback::build_callback cb)
+	{
+		std::wstring msg = L"Ошибка!: ";
+		std::string what = ex.what();
+		std::wstring wwhat(what.begin(), what.end());
+		msg += wwhat;
+		callback::SendCallback(msg.c_str(), Err, cb);
+		return 3;
+	}
+
+	extern "C" {
+
+		int API_ELF GetSymbolsAsync(const wchar_t** filters, size_t filterCount,
+			callback::build_callback cb, const wchar_t* path, int only_stmt,
+			progress_callback progress, symbols_completion done, uint64_t* request)
+		{
+			if (!path || !done || !request) return 2;
+
+			try
+			{
+				auto filter = ElfReader::ConvertFilters(filters, filterCount);
+				std::wstring file(path);
+
+				*request = RequestPool::Instance().Submit(RequestKey(L"symbols:", path, SymbolsQuery(filter, only_stmt)),
+					[=](uint64_t id, const std::atomic<bool>& cancelled) mutable {
+						if (cancelled) {
+							done(id, REQUEST_CANCELLED, nullptr, 0, 0);
+							return;
+						}
+
+						DecodeControl control;
+						control.cancel = &cancelled;
+						if (progress) control.progress = [=](double fraction) { progress(id, fraction); };
+
+						CLineEntry* arr = nullptr;
+						size_t count = 0;
+						uint64_t line = 0;
+						ElfReader reader(cb);
+						auto status = reader.CollectSymbols(file.c_str(), filter, only_stmt, &arr, &count, line, &control);
+						done(id, status, arr, count, line);
+					});
+				return 0;
+			}
+			catch (const std::exception& ex)
+			{
+				return ReportException(ex, cb);
+			}
+			catch (...)
+			{
+				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
+				return -4;
+			}
+		}
+
+		int API_ELF ElfAnalyzeAsync(const wchar_t* path, callback::build_callback cb,
+			analyze_completion done, uint64_t* request)
+		{
+			if (!path || !done || !request) return 2;
+
+			try
+			{
+				std::wstring file(path);
+
+				*request = RequestPool::Instance().Submit(RequestKey(L"analyze:", path),
+					[=](uint64_t id, const std::atomic<bool>& cancelled) {
+						if (cancelled) {
+							done(id, REQUEST_CANCELLED, nullptr);
+							return;
+						}
+
+						MemorySizes* memory = nullptr;
+						auto status = ElfAnalyze(file.c_str(), cb, &memory);
+						done(id, status, memory);
+					});
+				return 0;
+			}
+			catch (const std::exception& ex)
+			{
+				return ReportException(ex, cb);
+			}
+			catch (...)
+			{
+				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
+				return -4;
+			}
+		}
+
+		int API_ELF CancelRequest(uint64_t request)
+		{
+			try
+			{
+				return RequestPool::Instance().Cancel(request) ? 0 : 1;
+			}
+			catch (const std::exception&)
+			{
+				return 3;
+			}
+			catch (...)
+			{
+				return -4;
+			}
+		}
+	}
+}
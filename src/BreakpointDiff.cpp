@@ -0,0 +1,227 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <algorithm>
+#include <memory>
+
+
+namespace elfreader
+{
+	struct FirstAddress
+	{
+		uint32_t file;
+		uint32_t line;
+		uint64_t address;
+	};
+
+	struct BreakpointDiff
+	{
+		std::vector<CBreakpointMove> moves;
+		std::vector<std::pair<std::string, uint32_t>> removed;
+		std::vector<std::string> changed;
+	};
+
+	// наименьший адрес is_stmt для каждой пары (file, line), порядок stmtByLine
+	static std::vector<FirstAddress> FirstAddresses(const DecodedImage& image)
+	{
+		std::vector<FirstAddress> result;
+		for (auto index : image.stmtByLine) {
+			const auto& row = image.rows[index];
+			if (!result.empty() && result.back().file == row.file && result.back().line == row.line) continue;
+			result.push_back({ row.file, row.line, row.address });
+		}
+		return result;
+	}
+
+	// наименьший адрес кода файла, относительно него сравниваются адреса строк
+	static std::vector<uint64_t> FileBases(const DecodedImage& image, const std::vector<FirstAddress>& lines)
+	{
+		std::vector<uint64_t> bases(image.files.size(), UINT64_MAX);
+		for (const auto& entry : lines)
+			bases[entry.file] = std::min(bases[entry.file], entry.address);
+		return bases;
+	}
+
+	static std::vector<std::string> FileKeys(const DecodedImage& image)
+	{
+		std::vector<std::string> keys;
+		keys.reserve(image.files.size());
+		for (const auto& file : image.files) keys.push_back(ElfReader::ToLowerAscii(file));
+		return keys;
+	}
+
+	static int CompareLine(const std::string& fileA, uint32_t lineA, const std::string& fileB, uint32_t lineB)
+	{
+		if (int order = fileA.compare(fileB); order != 0) return order < 0 ? -1 : 1;
+		if (lineA != lineB) return lineA < lineB ? -1 : 1;
+		return 0;
+	}
+
+	// Один проход слиянием по таблицам строк обеих сборок, упорядоченным по (file, line)
+	static void DiffImages(const DecodedImage& oldImage, const DecodedImage& newImage,
+		const CBreakpointRequest* requests, size_t count, BreakpointDiff& diff)
+	{
+		auto oldKeys = FileKeys(oldImage);
+		auto newKeys = FileKeys(newImage);
+		auto oldLines = FirstAddresses(oldImage);
+		auto newLines = FirstAddresses(newImage);
+		auto oldBases = FileBases(oldImage, oldLines);
+		auto newBases = FileBases(newImage, newLines);
+
+		struct Pending { std::string key; uint32_t line; size_t index; };
+		std::vector<Pending> pending;
+		pending.reserve(count);
+		for (size_t i = 0; i < count; ++i) {
+			if (!requests[i].file) continue;
+			pending.push_back({ ElfReader::ToLowerAscii(ElfReader::ExtractFilename(requests[i].file)), requests[i].line, i });
+		}
+		std::ranges::sort(pending, [](const Pending& a, const Pending& b) { return CompareLine(a.key, a.line, b.key, b.line) < 0; });
+
+		diff.moves.assign(count, { 0, 0, BreakpointUnknown });
+		std::vector<char> oldChanged(oldImage.files.size());
+		std::vector<char> newChanged(newImage.files.size());
+
+		size_t i = 0, j = 0, r = 0;
+		while (i < oldLines.size() || j < newLines.size())
+		{
+			const auto* o = i < oldLines.size() ? &oldLines[i] : nullptr;
+			const auto* n = j < newLines.size() ? &newLines[j] : nullptr;
+			int order = !o ? 1 : !n ? -1 : CompareLine(oldKeys[o->file], o->line, newKeys[n->file], n->line);
+			const auto& key = order <= 0 ? oldKeys[o->file] : newKeys[n->file];
+			uint32_t line = order <= 0 ? o->line : n->line;
+
+			while (r < pending.size() && CompareLine(pending[r].key, pending[r].line, key, line) < 0) ++r;
+			for (; r < pending.size() && CompareLine(pending[r].key, pending[r].line, key, line) == 0; ++r) {
+				auto& move = diff.moves[pending[r].index];
+				move.oldAddress = order <= 0 ? o->address : 0;
+				move.newAddress = order >= 0 ? n->address : 0;
+				if (order > 0) move.state = BreakpointUnknown;
+				else if (order < 0) move.state = BreakpointRemoved;
+				else move.state = o->address == n->address ? BreakpointUnchanged : BreakpointMoved;
+			}
+
+			if (order < 0) {
+				diff.removed.emplace_back(oldImage.files[o->file], o->line);
+				oldChanged[o->file] = 1;
+				++i;
+			}
+			else if (order > 0) {
+				newChanged[n->file] = 1;
+				++j;
+			}
+			else {
+				if (o->address - oldBases[o->file] != n->address - newBases[n->file])
+					oldChanged[o->file] = newChanged[n->file] = 1;
+				++i;
+				++j;
+			}
+		}
+
+		for (size_t f = 0; f < oldChanged.size(); ++f)
+			if (oldChanged[f]) diff.changed.push_back(oldImage.files[f]);
+		for (size_t f = 0; f < newChanged.size(); ++f)
+			if (newChanged[f]) diff.changed.push_back(newImage.files[f]);
+		std::ranges::sort(diff.changed, {}, [](const std::string& name) { return ElfReader::ToLowerAscii(name); });
+		auto duplicates = std::ranges::unique(diff.changed, [](const std::string& a, const std::string& b) {
+			return ElfReader::ToLowerAscii(a) == ElfReader::ToLowerAscii(b);
+			});
+		diff.changed.erase(duplicates.begin(), duplicates.end());
+	}
+
+	static CBreakpointDiff* CopyDiff(const BreakpointDiff& diff)
+	{
+		auto result = static_cast<CBreakpointDiff*>(std::calloc(1, sizeof(CBreakpointDiff)));
+		if (!result) return nullptr;
+
+		result->moves = static_cast<CBreakpointMove*>(std::malloc(sizeof(CBreakpointMove) * std::max<size_t>(diff.moves.size(), 1)));
+		result->removed = static_cast<CSourceLine*>(std::calloc(std::max<size_t>(diff.removed.size(), 1), sizeof(CSourceLine)));
+		result->changedUnits = static_cast<char**>(std::calloc(std::max<size_t>(diff.changed.size(), 1), sizeof(char*)));
+		if (!result->moves || !result->removed || !result->changedUnits) {
+			FreeBreakpointDiff(result);
+			return nullptr;
+		}
+
+		std::ranges::copy(diff.moves, result->moves);
+		result->moveCount = diff.moves.size();
+
+		for (const auto& [file, line] : diff.removed)
+			result->removed[result->removedCount++] = { ElfReader::CopyString(file), line };
+
+		for (const auto& file : diff.changed)
+			result->changedUnits[result->changedCount++] = ElfReader::CopyString(file);
+
+		return result;
+	}
+
+	extern "C" {
+
+		int API_ELF DiffBreakpoints(const ElfSession* oldSession, const ElfSession* newSession,
+			const CBreakpointRequest* requests, size_t count,
+			callback::build_callback cb, CBreakpointDiff** diff)
+		{
+			*diff = nullptr;
+			if (!oldSession || !newSession || (count > 0 && !requests)) return 1;
+
+			try
+			{
+				BreakpointDiff result;
+				DiffImages(oldSession->image, newSession->image, requests, count, result);
+
+				*diff = CopyDiff(result);
+				if (!*diff)
+				{
+					callback::SendCallback(L"Ошибка выделения памяти!", Err, cb);
+					return 2;
+				}
+				return 0;
+			}
+			catch (const std::exception& ex)
+			{
+				std::wstring msg = L"Ошибка!: ";
+				std::string what = ex.what();
+				std::wstring wwhat(what.begin(), what.end());
+				msg += wwhat;
+				callback::SendCallback(msg.c_str(), Err, cb);
+				return 3;
+			}
+			catch (...)
+			{
+				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
+				return -4;
+			}
+		}
+
+		int API_ELF DiffBreakpointFiles(const wchar_t* oldPath, const wchar_t* newPath,
+			const CBreakpointRequest* requests, size_t count,
+			callback::build_callback cb, CBreakpointDiff** diff)
+		{
+			*diff = nullptr;
+
+			ElfSession* oldSession = nullptr;
+			if (auto status = OpenElfSession(oldPath, cb, &oldSession); status != 0) return status;
+			std::unique_ptr<ElfSession, decltype(&CloseElfSession)> oldGuard(oldSession, &CloseElfSession);
+
+			ElfSession* newSession = nullptr;
+			if (auto status = OpenElfSession(newPath, cb, &newSession); status != 0) return status;
+			std::unique_ptr<ElfSession, decltype(&CloseElfSession)> newGuard(newSession, &CloseElfSession);
+
+			return DiffBreakpoints(oldSession, newSession, requests, count, cb, diff);
+		}
+
+		void API_ELF FreeBreakpointDiff(CBreakpointDiff* diff)
+		{
+			if (!diff) return;
+			if (diff->removed) {
+				for (size_t i = 0; i < diff->removedCount; ++i)
+					if (diff->removed[i].file) std::free(diff->removed[i].file);
+				std::free(diff->removed);
+			}
+			if (diff->changedUnits) {
+				for (size_t i = 0; i < diff->changedCount; ++i)
+					if (diff->changedUnits[i]) std::free(diff->changedUnits[i]);
+				std::free(diff->changedUnits);
+			}
+			if (diff->moves) std::free(diff->moves);
+			std::free(diff);
+		}
+	}
+}
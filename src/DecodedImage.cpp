@@ -0,0 +1,175 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <algorithm>
+#include <numeric>
+
+
+namespace elfreader
+{
+	void DecodedImage::Finalize()
+	{
+		// файлы по имени без учёта регистра, чтобы индексы двух образов сравнивались по порядку имён
+		std::vector<std::string> keys(files.size());
+		for (size_t i = 0; i < files.size(); ++i) keys[i] = ElfReader::ToLowerAscii(files[i]);
+
+		std::vector<uint32_t> order(files.size());
+		std::iota(order.begin(), order.end(), 0u);
+		std::ranges::sort(order, [&](uint32_t a, uint32_t b) {
+			if (keys[a] != keys[b]) return keys[a] < keys[b];
+			return files[a] < files[b];
+			});
+
+		std::vector<uint32_t> remap(files.size());
+		std::vector<std::string> sortedFiles(files.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			remap[order[i]] = static_cast<uint32_t>(i);
+			sortedFiles[i] = std::move(files[order[i]]);
+		}
+		files = std::move(sortedFiles);
+		for (auto& row : rows)
+			if (row.file != NO_FILE) row.file = remap[row.file];
+
+		// последовательности кода, выброшенного --gc-sections, остаются в .debug_line с адреса 0
+		// и пересекаются друг с другом и с настоящим кодом, оставляем только начинающиеся в секциях кода
+		auto inCode = [&](uint64_t address) {
+			if (codeRanges.empty()) return true;
+			return std::ranges::any_of(codeRanges, [&](const auto& range) { return address >= range.first && address < range.second; });
+			};
+
+		// последовательности идут в rows подряд, сортируем их целиком по начальному адресу
+		struct Sequence { uint64_t start; size_t begin; size_t end; };
+		std::vector<Sequence> sequences;
+		for (size_t i = 0; i < rows.size();) {
+			size_t j = i;
+			while (j < rows.size() && rows[j].sequence == rows[i].sequence) ++j;
+			if (inCode(rows[i].address)) sequences.push_back({ rows[i].address, i, j });
+			i = j;
+		}
+		std::ranges::stable_sort(sequences, {}, &Sequence::start);
+
+		std::vector<LineRow> sortedRows;
+		sortedRows.reserve(rows.size());
+		for (const auto& seq : sequences)
+			sortedRows.insert(sortedRows.end(), rows.begin() + seq.begin, rows.begin() + seq.end);
+		rows = std::move(sortedRows);
+
+		auto byLine = [&](uint32_t a, uint32_t b) {
+			const auto& ra = rows[a];
+			const auto& rb = rows[b];
+			if (ra.file != rb.file) return ra.file < rb.file;
+			if (ra.line != rb.line) return ra.line < rb.line;
+			return ra.address < rb.address;
+			};
+
+		rowsByLine.clear();
+		stmtByLine.clear();
+		for (size_t i = 0; i < rows.size(); ++i) {
+			if (rows[i].end_sequence) continue;
+			rowsByLine.push_back(static_cast<uint32_t>(i));
+			if (rows[i].is_stmt) stmtByLine.push_back(static_cast<uint32_t>(i));
+		}
+		std::ranges::sort(rowsByLine, byLine);
+		std::ranges::sort(stmtByLine, byLine);
+
+		std::ranges::sort(symbols, [](const SymbolInfo& a, const SymbolInfo& b) {
+			if (a.address != b.address) return a.address < b.address;
+			return a.size > b.size;
+			});
+
+		// псевдонимы и вложенные символы отбрасываем, остаётся один символ на диапазон
+		functions.clear();
+		uint64_t covered = 0;
+		for (size_t i = 0; i < symbols.size(); ++i) {
+			const auto& sym = symbols[i];
+			if (sym.type != ELFIO::STT_FUNC || sym.size == 0) continue;
+			if (!functions.empty() && sym.address < covered) continue;
+			functions.push_back(static_cast<uint32_t>(i));
+			covered = sym.address + sym.size;
+		}
+
+		symbolsByName.resize(symbols.size());
+		std::iota(symbolsByName.begin(), symbolsByName.end(), 0u);
+		std::ranges::sort(symbolsByName, [&](uint32_t a, uint32_t b) { return symbols[a].name < symbols[b].name; });
+	}
+
+	const LineRow* DecodedImage::FindRow(uint64_t address) const
+	{
+		auto it = std::ranges::upper_bound(rows, address, {}, &LineRow::address);
+		if (it == rows.begin()) return nullptr;
+		--it;
+		return it->end_sequence ? nullptr : &*it;
+	}
+
+	uint64_t DecodedImage::RowEnd(size_t index) const
+	{
+		const auto& row = rows[index];
+		if (row.end_sequence || index + 1 >= rows.size()) return row.address;
+		const auto& next = rows[index + 1];
+		return next.sequence == row.sequence ? next.address : row.address;
+	}
+
+	uint32_t DecodedImage::FunctionIndex(uint64_t address) const
+	{
+		auto it = std::ranges::upper_bound(functions, address, {}, [&](uint32_t i) { return symbols[i].address; });
+		if (it == functions.begin()) return NO_FUNCTION;
+		--it;
+		const auto& sym = symbols[*it];
+		return address < sym.address + sym.size ? static_cast<uint32_t>(it - functions.begin()) : NO_FUNCTION;
+	}
+
+	const SymbolInfo* DecodedImage::FindFunction(uint64_t address) const
+	{
+		auto index = FunctionIndex(address);
+		return index == NO_FUNCTION ? nullptr : &symbols[functions[index]];
+	}
+
+	const SymbolInfo* DecodedImage::FindSymbol(const std::string& name) const
+	{
+		auto it = std::ranges::lower_bound(symbolsByName, name, {}, [&](uint32_t i) -> const std::string& { return symbols[i].name; });
+		if (it == symbolsByName.end() || symbols[*it].name != name) return nullptr;
+		return &symbols[*it];
+	}
+
+	uint32_t DecodedImage::FindFile(const std::string& name) const
+	{
+		auto key = ElfReader::ToLowerAscii(name);
+		auto it = std::ranges::lower_bound(files, key, {}, [](const std::string& f) { return ElfReader::ToLowerAscii(f); });
+		if (it == files.end() || ElfReader::ToLowerAscii(*it) != key) return NO_FILE;
+		return static_cast<uint32_t>(it - files.begin());
+	}
+
+	uint32_t DecodedImage::ResolveBreakpoint(uint32_t file, uint32_t line, std::vector<uint64_t>& addresses) const
+	{
+		// первая строка с кодом не раньше запрошенной, как точки останова в gdb
+		auto it = std::ranges::lower_bound(stmtByLine, std::make_pair(file, line), {}, [&](uint32_t i) {
+			return std::make_pair(rows[i].file, rows[i].line);
+			});
+		if (it == stmtByLine.end() || rows[*it].file != file) return 0;
+
+		uint32_t actual = rows[*it].line;
+		for (; it != stmtByLine.end() && rows[*it].file == file && rows[*it].line == actual; ++it) {
+			if (addresses.empty() || addresses.back() != rows[*it].address)
+				addresses.push_back(rows[*it].address);
+		}
+		return actual;
+	}
+
+	std::span<const uint32_t> DecodedImage::LineRows(uint32_t file, uint32_t firstLine, uint32_t lastLine) const
+	{
+		auto key = [&](uint32_t i) { return std::make_pair(rows[i].file, rows[i].line); };
+		auto first = std::ranges::lower_bound(rowsByLine, std::make_pair(file, firstLine), {}, key);
+		auto last = std::ranges::upper_bound(first, rowsByLine.end(), std::make_pair(file, lastLine), {}, key);
+		return { first, last };
+	}
+
+	size_t DecodedImage::Footprint() const
+	{
+		size_t bytes = sizeof(DecodedImage)
+			+ rows.capacity() * sizeof(LineRow)
+			+ (rowsByLine.capacity() + stmtByLine.capacity() + functions.capacity() + symbolsByName.capacity()) * sizeof(uint32_t)
+			+ symbols.capacity() * sizeof(SymbolInfo);
+		for (const auto& file : files) bytes += sizeof(std::string) + file.capacity();
+		for (const auto& sym : symbols) bytes += sym.name.capacity();
+		return bytes;
+	}
+}
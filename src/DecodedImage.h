@@ -0,0 +1,120 @@
+﻿#pragma once
+
+#include <ElfReader.h>
+#include <mutex>
+#include <span>
+
+// Внутреннее представление декодированного ELF. Не экспортируется из DLL:
+// в ElfReader.h эти типы только объявлены, клиенты работают через C API.
+namespace elfreader
+{
+	// Строка таблицы .debug_line в числовом виде
+	struct LineRow
+	{
+		uint64_t address;
+		uint32_t file;			// индекс в DecodedImage::files
+		uint32_t line;
+		uint32_t sequence;
+		bool is_stmt;
+		bool basic_block;
+		//DW_LNE_end_sequence: адрес первого байта после последовательности, строка не исполняется
+		bool end_sequence;
+		//DW_LNS_set_epilogue_begin (DWARF 3+), GCC не выставляет
+		bool epilogue_begin;
+	};
+
+	struct SymbolInfo
+	{
+		std::string name;
+		uint64_t address;
+		uint64_t size;
+		uint8_t type;			// STT_FUNC или STT_OBJECT
+	};
+
+	// Полностью декодированный ELF: размеры памяти, таблица строк и символы.
+	// После Finalize() структура только читается и может использоваться из нескольких потоков.
+	struct DecodedImage
+	{
+		MemorySizes memory;
+		//имена файлов, упорядочены без учёта регистра
+		std::vector<std::string> files;
+		//последовательности упорядочены по начальному адресу, внутри последовательности порядок .debug_line
+		std::vector<LineRow> rows;
+		//индексы всех строк rows, кроме end_sequence, упорядочены по (file, line, address)
+		std::vector<uint32_t> rowsByLine;
+		//индексы is_stmt строк rows, упорядочены по (file, line, address)
+		std::vector<uint32_t> stmtByLine;
+		//упорядочены по адресу
+		std::vector<SymbolInfo> symbols;
+		//индексы STT_FUNC с ненулевым размером в symbols, по адресу, без пересечений
+		std::vector<uint32_t> functions;
+		std::vector<uint32_t> symbolsByName;
+		//[начало, конец) секций SHF_ALLOC | SHF_EXECINSTR
+		std::vector<std::pair<uint64_t, uint64_t>> codeRanges;
+
+		void Finalize();
+
+		const LineRow* FindRow(uint64_t address) const;
+		uint64_t RowEnd(size_t index) const;
+		const SymbolInfo* FindFunction(uint64_t address) const;
+		//индекс в functions или NO_FUNCTION
+		uint32_t FunctionIndex(uint64_t address) const;
+		const SymbolInfo* FindSymbol(const std::string& name) const;
+		uint32_t FindFile(const std::string& name) const;
+		//индексы rowsByLine для строк [firstLine, lastLine] файла
+		std::span<const uint32_t> LineRows(uint32_t file, uint32_t firstLine, uint32_t lastLine) const;
+		uint32_t ResolveBreakpoint(uint32_t file, uint32_t line, std::vector<uint64_t>& addresses) const;
+		size_t Footprint() const;
+	};
+
+	constexpr uint32_t NO_STMT = UINT32_MAX;
+
+	// Таблица шагов отладчика: начала операторов (is_stmt) каждой функции из DecodedImage::functions
+	struct StepTable
+	{
+		struct Function
+		{
+			uint32_t firstStmt;
+			uint32_t stmtCount;
+			uint32_t firstExit;
+			uint32_t exitCount;
+			//exits взяты из DW_LNS_set_epilogue_begin, иначе это оценка
+			bool epilogue;
+		};
+
+		//параллельно DecodedImage::functions
+		std::vector<Function> functions;
+		//по адресу внутри каждой функции
+		std::vector<uint64_t> stmts;
+		//индекс следующего по адресу оператора функции с другой строкой, NO_STMT - такого нет.
+		//Это продолжение без переходов, а не место остановки шага
+		std::vector<uint32_t> nextStmt;
+		//ключ строки (file, line) оператора, номер строки внутри функции
+		std::vector<uint32_t> lineKeys;
+		//начала выходов функции по адресу: эпилоги, а без отметок эпилога - участки
+		//последней строки основного файла функции, обычно закрывающей скобки
+		std::vector<uint64_t> exits;
+		//конец участка той же строки, начатого exits[i]
+		std::vector<uint64_t> exitEnds;
+		//ключ строки выхода в тех же номерах, что lineKeys
+		std::vector<uint32_t> exitKeys;
+
+		void Build(const DecodedImage& image);
+
+	private:
+		void AddExits(const DecodedImage& image, uint64_t start, uint64_t end, Function& fn,
+			std::vector<std::pair<uint32_t, uint32_t>>& exitLines);
+	};
+
+	// Открытый через C API образ, живёт до CloseElfSession
+	struct ElfSession
+	{
+		DecodedImage image;
+
+		const StepTable& Steps();
+
+	private:
+		std::once_flag m_stepsOnce;
+		StepTable m_steps;
+	};
+}
@@ -1,5 +1,7 @@
 ﻿#include <ElfReader.h>
+#include "DecodedImage.h"
 #include <Windows.h>
+#include <unordered_map>
 
 
 namespace elfreader
@@ -72,6 +74,19 @@ namespace elfreader
 		return path;
 	}
 
+	std::string ElfReader::ToLowerAscii(std::string value)
+	{
+		std::ranges::transform(value, value.begin(), [](const unsigned char c) {return std::tolower(c); });
+		return value;
+	}
+
+	char* ElfReader::CopyString(const std::string& value)
+	{
+		auto str = static_cast<char*>(std::malloc(value.size() + 1));
+		if (str) std::memcpy(str, value.c_str(), value.size() + 1);
+		return str;
+	}
+
 	std::string ElfReader::ToHexAddr(uint64_t value)
 	{
 		char buf[32];
@@ -79,14 +94,8 @@ namespace elfreader
 		return std::string(buf);
 	}
 
-	MemorySizes* ElfReader::Analyze(const std::filesystem::path& elfPath)
+	void ElfReader::ComputeMemorySizes(const ELFIO::elfio& reader, MemorySizes& mem)
 	{
-		auto mem = AllocateMemorySizes();
-		ELFIO::elfio reader;
-		if (!reader.load(elfPath.string())) {
-			throw std::runtime_error("Не удалось открыть ELF: " + elfPath.string());
-		}
-
 		for (int i = 0; i < reader.segments.size(); ++i) {
 			const ELFIO::segment* seg = reader.segments[i];
 
@@ -97,18 +106,29 @@ namespace elfreader
 			auto flags = seg->get_flags();
 
 			if (flags & ELFIO::PF_X) {
-				mem->text += filesz;
+				mem.text += filesz;
 			}
 			else if (flags & ELFIO::PF_W) {
-				mem->data += filesz;
-				if (memsz > filesz) mem->bss += (memsz - filesz);
+				mem.data += filesz;
+				if (memsz > filesz) mem.bss += (memsz - filesz);
 			}
 		}
 
-		mem->flash = mem->text;
-		mem->ram = mem->data + mem->bss;
-		mem->binSize = mem->text + mem->data;
-		mem->dec = mem->text + mem->data + mem->bss;
+		mem.flash = mem.text;
+		mem.ram = mem.data + mem.bss;
+		mem.binSize = mem.text + mem.data;
+		mem.dec = mem.text + mem.data + mem.bss;
+	}
+
+	MemorySizes* ElfReader::Analyze(const std::filesystem::path& elfPath)
+	{
+		auto mem = AllocateMemorySizes();
+		ELFIO::elfio reader;
+		if (!reader.load(elfPath.string())) {
+			throw std::runtime_error("Не удалось открыть ELF: " + elfPath.string());
+		}
+
+		ComputeMemorySizes(reader, *mem);
 
 		std::wstringstream ss;
 		ss << L"text=" << mem->text
@@ -149,34 +169,20 @@ namespace elfreader
 		return false;
 	}
 
-	int ElfReader::ParseDebugLine(const std::filesystem::path& elfPath, std::vector<LineEntry>& out_lines, std::vector<std::string>& filteredName, int only_stmt, uint64_t& line)
+	bool ElfReader::DecodeLineProgram(const char* data, size_t size, std::vector<std::string>& files, std::vector<LineRow>& rows,
+		const DecodeControl* control)
 	{
-		ELFIO::elfio reader;
-		if (!reader.load(elfPath.string()))
-		{
-			std::wstring message = L"Не удалось открыть ELF: " + elfPath.wstring();
-			callback::SendCallback(message.c_str(), Err, m_cb);
-			return -1;
-		}
-
-		const ELFIO::section* debug_line = reader.sections[".debug_line"];
-		if (!debug_line) {
-			callback::SendCallback(L".debug_line not found", Err, m_cb);
-			return -1;
-		}
-
-		const char* data = debug_line->get_data();
-		size_t size = debug_line->get_size();
-
+		std::unordered_map<std::string, uint32_t> file_indices;
+		uint32_t sequence = 0;
 		size_t offset = 0;
 
-
-		std::string last_emitted_file;
-		uint64_t last_emitted_address = UINT64_MAX;
-		size_t repeat_counter = 0;
-
 		while (offset + 4 <= size)
 		{
+			if (control) {
+				if (control->cancel && control->cancel->load(std::memory_order_relaxed)) return false;
+				if (control->progress) control->progress(static_cast<double>(offset) / static_cast<double>(size));
+			}
+
 			uint32_t unit_length = ReadU32(data, size, offset);
 			if (unit_length == 0) break;
 			if (offset + unit_length > size) break;
@@ -195,6 +201,8 @@ namespace elfreader
 			if (offset >= size) break;
 			uint8_t min_insn_len = static_cast<uint8_t>(data[offset++]);
 
+			if (version >= 4) offset++; // maximum_operations_per_instruction, только для VLIW
+
 			uint8_t default_is_stmt = 0;
 			ReadLineHeader(data, default_is_stmt, size, offset);
 
@@ -226,7 +234,7 @@ namespace elfreader
 				include_dirs.push_back(dir);
 			}
 
-			std::vector<std::string> file_list;
+			std::vector<uint32_t> file_list; // локальный индекс unit -> индекс в files
 			while (offset < header_end)
 			{
 				std::string fname;
@@ -244,7 +252,10 @@ namespace elfreader
 					if (!include_dirs[dir_index - 1].empty())
 						fullpath = include_dirs[dir_index - 1] + "/" + fname;
 				}
-				file_list.push_back(ExtractFilename(fullpath));
+
+				auto [it, inserted] = file_indices.try_emplace(ExtractFilename(fullpath), static_cast<uint32_t>(files.size()));
+				if (inserted) files.push_back(it->first);
+				file_list.push_back(it->second);
 			}
 
 			offset = header_end;
@@ -253,8 +264,8 @@ namespace elfreader
 			uint32_t line = 1;
 			bool is_stmt = default_is_stmt ? true : false; //считается ли текущая позиция "началом исполняемого оператора" (statement)
 			bool basic_block = false; // Флаг "начало базового блока"
+			bool epilogue_begin = false; // DW_LNS_set_epilogue_begin: строка начинает эпилог функции
 			size_t file_index = 0;
-			uint64_t sequence_base = UINT64_MAX;
 
 			while (offset < unit_end)
 			{
@@ -270,15 +281,15 @@ namespace elfreader
 
 					if (ex_opcode == 1) // DW_LNE_end_sequence
 					{
+						auto file = file_index < file_list.size() ? file_list[file_index] : NO_FILE;
+						rows.push_back({ address, file, line, sequence++, is_stmt, basic_block, true });
+
 						basic_block = false;
+						epilogue_begin = false;
 						address = 0;
 						line = 1;
 						is_stmt = default_is_stmt ? true : false;
 						file_index = 0;
-						sequence_base = UINT64_MAX;
-						last_emitted_file.clear();
-						last_emitted_address = UINT64_MAX;
-						repeat_counter = 0;
 					}
 					else if (ex_opcode == 2) // DW_LNE_set_address
 					{
@@ -289,7 +300,6 @@ namespace elfreader
 						else {
 							address = ReadAddrBytes(data, size, offset, addr_bytes);
 						}
-						if (sequence_base == UINT64_MAX) sequence_base = address;
 					}
 					else
 					{
@@ -304,26 +314,9 @@ namespace elfreader
 					case 1: // DW_LNS_copy -> EMIT
 					{
 						if (file_index < file_list.size())
-						{
-							auto current_file = file_list[file_index];
-							auto current_address = address;
-
-							uint32_t view_val = 0;
-							if (current_file == last_emitted_file && current_address == last_emitted_address) {
-								++repeat_counter;
-								view_val = static_cast<uint32_t>(repeat_counter);
-							}
-							else {
-								last_emitted_file = current_file;
-								last_emitted_address = current_address;
-								repeat_counter = 0;
-								view_val = 0;
-							}
-
-							if (FiltredResult(filteredName, file_list[file_index]) && (only_stmt == 0 || is_stmt))
-								out_lines.push_back({ file_list[file_index], ToHexAddr(address), line, is_stmt, basic_block, view_val });
-						}
+							rows.push_back({ address, file_list[file_index], line, sequence, is_stmt, basic_block, false, epilogue_begin });
 						basic_block = false;
+						epilogue_begin = false;
 						break;
 					}
 					case 2: // DW_LNS_advance_pc
@@ -368,6 +361,25 @@ namespace elfreader
 						basic_block = true;
 						break;
 					}
+					case 8: // DW_LNS_const_add_pc, сдвиг адреса как у special opcode 255
+					{
+						int adj = 255 - static_cast<int>(opcode_base);
+						if (line_range != 0)
+							address += static_cast<uint64_t>(adj / static_cast<int>(line_range)) * min_insn_len;
+						break;
+					}
+					case 9: // DW_LNS_fixed_advance_pc, операнд uhalf без умножения на min_insn_len
+					{
+						if (offset + 2 > size) { offset = size; break; }
+						address += static_cast<uint8_t>(data[offset]) | (static_cast<uint8_t>(data[offset + 1]) << 8);
+						offset += 2;
+						break;
+					}
+					case 11: // DW_LNS_set_epilogue_begin
+					{
+						epilogue_begin = true;
+						break;
+					}
 					default:
 					{
 						size_t idx = static_cast<size_t>(opcode - 1);
@@ -392,38 +404,141 @@ namespace elfreader
 					address += static_cast<uint64_t>(addr_inc);
 
 					if (file_index < file_list.size())
-					{
-						auto current_file = file_list[file_index];
-						auto current_address = address;
-
-						uint32_t view_val = 0;
-						if (current_file == last_emitted_file && current_address == last_emitted_address) {
-							++repeat_counter;
-							view_val = static_cast<uint32_t>(repeat_counter);
-						}
-						else {
-							last_emitted_file = current_file;
-							last_emitted_address = current_address;
-							repeat_counter = 0;
-							view_val = 0;
-						}
-
-						if (FiltredResult(filteredName, file_list[file_index]) && (only_stmt == 0 || is_stmt))
-							out_lines.push_back({ file_list[file_index], ToHexAddr(address), line, is_stmt, basic_block, view_val });
-					}
+						rows.push_back({ address, file_list[file_index], line, sequence, is_stmt, basic_block, false, epilogue_begin });
 					basic_block = false;
+					epilogue_begin = false;
 				}
 			}
 
 			offset = unit_end;
 		}
 
+		if (control && control->progress) control->progress(1.0);
+		return true;
+	}
+
+	int ElfReader::ParseDebugLine(const std::filesystem::path& elfPath, std::vector<LineEntry>& out_lines, std::vector<std::string>& filteredName, int only_stmt, uint64_t& line,
+		const DecodeControl* control)
+	{
+		ELFIO::elfio reader;
+		if (!reader.load(elfPath.string()))
+		{
+			std::wstring message = L"Не удалось открыть ELF: " + elfPath.wstring();
+			callback::SendCallback(message.c_str(), Err, m_cb);
+			return -1;
+		}
+
+		const ELFIO::section* debug_line = reader.sections[".debug_line"];
+		if (!debug_line) {
+			callback::SendCallback(L".debug_line not found", Err, m_cb);
+			return -1;
+		}
+
+		std::vector<std::string> files;
+		std::vector<LineRow> rows;
+		if (!DecodeLineProgram(debug_line->get_data(), debug_line->get_size(), files, rows, control))
+			return REQUEST_CANCELLED;
+
+		std::vector<char> accepted(files.size());
+		for (size_t i = 0; i < files.size(); ++i)
+			accepted[i] = FiltredResult(filteredName, files[i]);
+
+		uint32_t last_emitted_file = NO_FILE;
+		uint64_t last_emitted_address = UINT64_MAX;
+		size_t repeat_counter = 0;
+
+		for (const auto& row : rows)
+		{
+			if (row.end_sequence)
+			{
+				last_emitted_file = NO_FILE;
+				last_emitted_address = UINT64_MAX;
+				repeat_counter = 0;
+				continue;
+			}
+
+			uint32_t view_val = 0;
+			if (row.file == last_emitted_file && row.address == last_emitted_address) {
+				++repeat_counter;
+				view_val = static_cast<uint32_t>(repeat_counter);
+			}
+			else {
+				last_emitted_file = row.file;
+				last_emitted_address = row.address;
+				repeat_counter = 0;
+			}
+
+			if (accepted[row.file] && (only_stmt == 0 || row.is_stmt))
+				out_lines.push_back({ files[row.file], ToHexAddr(row.address), row.line, row.is_stmt, row.basic_block, view_val });
+		}
+
 
 		line = FindFunctionLine(reader, "READ_WRITE_EXAMPLE_body__", out_lines);
 
 		return 0;
 	}
 
+	void ElfReader::ReadSymbols(const ELFIO::elfio& reader, std::vector<SymbolInfo>& out_symbols)
+	{
+		const auto symtab = reader.sections[".symtab"];
+		if (!symtab) return;
+
+		// у Thumb-функций ARM младший бит адреса символа указывает режим, а не адрес
+		bool thumb = reader.get_machine() == ELFIO::EM_ARM;
+
+		const ELFIO::symbol_section_accessor symbols(reader, symtab);
+		auto symCount = symbols.get_symbols_num();
+
+		for (ELFIO::Elf_Xword i = 0; i < symCount; ++i) {
+			std::string name;
+			ELFIO::Elf64_Addr value = 0;
+			ELFIO::Elf_Xword size = 0;
+			unsigned char bind = 0, type = 0, other = 0;
+			ELFIO::Elf_Half shndx = 0;
+
+			symbols.get_symbol(i, name, value, size, bind, type, shndx, other);
+
+			if (name.empty() || shndx == ELFIO::SHN_UNDEF) continue;
+			if (type != ELFIO::STT_FUNC && type != ELFIO::STT_OBJECT) continue;
+			if (type == ELFIO::STT_FUNC && thumb) value &= ~static_cast<ELFIO::Elf64_Addr>(1);
+
+			out_symbols.push_back({ std::move(name), value, size, type });
+		}
+	}
+
+	void ElfReader::ReadCodeRanges(const ELFIO::elfio& reader, std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+	{
+		for (const auto& sec : reader.sections) {
+			auto flags = sec->get_flags();
+			if ((flags & ELFIO::SHF_ALLOC) == 0 || (flags & ELFIO::SHF_EXECINSTR) == 0 || sec->get_size() == 0) continue;
+			ranges.emplace_back(sec->get_address(), sec->get_address() + sec->get_size());
+		}
+	}
+
+	int ElfReader::Decode(const std::filesystem::path& elfPath, DecodedImage& image)
+	{
+		ELFIO::elfio reader;
+		if (!reader.load(elfPath.string()))
+		{
+			std::wstring message = L"Не удалось открыть ELF: " + elfPath.wstring();
+			callback::SendCallback(message.c_str(), Err, m_cb);
+			return -1;
+		}
+
+		ComputeMemorySizes(reader, image.memory);
+
+		const ELFIO::section* debug_line = reader.sections[".debug_line"];
+		if (debug_line)
+			DecodeLineProgram(debug_line->get_data(), debug_line->get_size(), image.files, image.rows);
+		else
+			callback::SendCallback(L".debug_line not found", Warn, m_cb);
+
+		ReadSymbols(reader, image.symbols);
+		ReadCodeRanges(reader, image.codeRanges);
+		image.Finalize();
+		return 0;
+	}
+
 	uint64_t ElfReader::FindFunctionLine(ELFIO::elfio& reader, const std::string& funcName, const std::vector<LineEntry>& lines)
 	{
 		const auto symtab = reader.sections[".symtab"];
@@ -454,82 +569,101 @@ namespace elfreader
 	}
 
 
-	extern "C" {
+	std::vector<std::string> ElfReader::ConvertFilters(const wchar_t** filters, size_t filterCount)
+	{
+		std::vector<std::string> filter;
+		for (size_t i = 0; i < filterCount; ++i)
+		{
+			if (filters[i] == nullptr) continue;
+			std::wstring ws(filters[i]);
+			std::string str;
+			str.resize(ws.size() * 4);
+			str = std::string(ws.begin(), ws.end());
+			filter.push_back(str);
+		}
+		return filter;
+	}
 
-		int API_ELF GetSymbols(const wchar_t** filters, size_t filterCount,
-			callback::build_callback cb,
-			CLineEntry** outArray, size_t* outCount,
-			const wchar_t* path, int only_stmt, uint64_t& line)
+	int ElfReader::CollectSymbols(const wchar_t* path, std::vector<std::string>& filter, int only_stmt,
+		CLineEntry** outArray, size_t* outCount, uint64_t& line,
+		const DecodeControl* control)
+	{
+		try
 		{
-			try
+			std::vector<LineEntry> results;
+			auto result = ParseDebugLine(std::wstring(path), results, filter, only_stmt, line, control);
+			if (result == REQUEST_CANCELLED)
 			{
-				std::vector<std::string> filter;
-				for (size_t i = 0; i < filterCount; ++i)
-				{
-					if (filters[i] == nullptr) continue;
-					std::wstring ws(filters[i]);
-					std::string str;
-					str.resize(ws.size() * 4);
-					str = std::string(ws.begin(), ws.end());
-					filter.push_back(str);
-				}
-
-				std::vector<LineEntry> results;
-				ElfReader reader(cb);
-				auto result = reader.ParseDebugLine(std::wstring(path), results, filter, only_stmt, line);
-
-				auto size = results.size();
-				if (size == 0)
-				{
-					*outArray = nullptr;
-					*outCount = 0;
-					return 0;
-				}
-
-				auto arr = static_cast<CLineEntry*>(std::malloc(sizeof(CLineEntry) * size));
-				if (!arr)
-				{
-					callback::SendCallback(L"Ошибка выделения памяти!", Err, cb);
-					return 2;
-				}
-
-
-				for (size_t i = 0; i < size; ++i)
-				{
-					const auto& entry = results[i];
-					const std::string& file = entry.file;
-					arr[i].file = static_cast<char*>(std::malloc(file.size() + 1));
-					if (arr[i].file) std::memcpy(arr[i].file, file.c_str(), file.size() + 1);
-
-					const std::string& addr = entry.address;
-					arr[i].address = static_cast<char*>(std::malloc(addr.size() + 1));
-					if (arr[i].address) std::memcpy(arr[i].address, addr.c_str(), addr.size() + 1);
-
-					arr[i].line = entry.line;
-					arr[i].is_stmt = entry.is_stmt ? 1 : 0;
-					arr[i].basic_block = entry.basic_block ? 1 : 0;
-					arr[i].view_val = entry.view;
-				}
+				*outArray = nullptr;
+				*outCount = 0;
+				return REQUEST_CANCELLED;
+			}
 
-				*outArray = arr;
-				*outCount = size;
+			auto size = results.size();
+			if (size == 0)
+			{
+				*outArray = nullptr;
+				*outCount = 0;
 				return 0;
-
 			}
-			catch (const std::exception& ex)
+
+			auto arr = static_cast<CLineEntry*>(std::malloc(sizeof(CLineEntry) * size));
+			if (!arr)
 			{
-				std::wstring msg = L"Ошибка!: ";
-				std::string what = ex.what();
-				std::wstring wwhat(what.begin(), what.end());
-				msg += wwhat;
-				callback::SendCallback(msg.c_str(), Err, cb);
-				return 3;
+				callback::SendCallback(L"Ошибка выделения памяти!", Err, m_cb);
+				return 2;
 			}
-			catch (...)
+
+
+			for (size_t i = 0; i < size; ++i)
 			{
-				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
-				return -4;
+				const auto& entry = results[i];
+				const std::string& file = entry.file;
+				arr[i].file = static_cast<char*>(std::malloc(file.size() + 1));
+				if (arr[i].file) std::memcpy(arr[i].file, file.c_str(), file.size() + 1);
+
+				const std::string& addr = entry.address;
+				arr[i].address = static_cast<char*>(std::malloc(addr.size() + 1));
+				if (arr[i].address) std::memcpy(arr[i].address, addr.c_str(), addr.size() + 1);
+
+				arr[i].line = entry.line;
+				arr[i].is_stmt = entry.is_stmt ? 1 : 0;
+				arr[i].basic_block = entry.basic_block ? 1 : 0;
+				arr[i].view_val = entry.view;
 			}
+
+			*outArray = arr;
+			*outCount = size;
+			return 0;
+
+		}
+		catch (const std::exception& ex)
+		{
+			std::wstring msg = L"Ошибка!: ";
+			std::string what = ex.what();
+			std::wstring wwhat(what.begin(), what.end());
+			msg += wwhat;
+			callback::SendCallback(msg.c_str(), Err, m_cb);
+			return 3;
+		}
+		catch (...)
+		{
+			callback::SendCallback(L"Неизвестная ошибка!", Err, m_cb);
+			return -4;
+		}
+	}
+
+
+	extern "C" {
+
+		int API_ELF GetSymbols(const wchar_t** filters, size_t filterCount,
+			callback::build_callback cb,
+			CLineEntry** outArray, size_t* outCount,
+			const wchar_t* path, int only_stmt, uint64_t& line)
+		{
+			auto filter = ElfReader::ConvertFilters(filters, filterCount);
+			ElfReader reader(cb);
+			return reader.CollectSymbols(path, filter, only_stmt, outArray, outCount, line);
 		}
 
 		int API_ELF ElfAnalyze(const wchar_t* path, callback::build_callback cb, MemorySizes** memory)
@@ -0,0 +1,441 @@
+﻿#include <winsock2.h>
+#include <afunix.h>
+#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <ElfQueryProtocol.h>
+#include <algorithm>
+#include <cstring>
+#include <cwctype>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+using namespace elfreader;
+using namespace elfquery;
+
+// Сообщения декодера в журнал сервера
+static void __stdcall LogDecodeEvent(const callback::BuildEvent* ev)
+{
+	static std::mutex logMutex;
+	{
+		std::lock_guard lock(logMutex);
+		std::wcerr << ev->typeResult << L" " << ev->message << std::endl;
+	}
+	std::free(const_cast<wchar_t*>(ev->message));
+	std::free(const_cast<wchar_t*>(ev->typeResult));
+	delete ev;
+}
+
+// Кэш декодированных образов: LRU с ограничением по занимаемой памяти.
+// Образ перечитывается, если у файла изменились время записи или размер.
+// Одновременные промахи по одному образу ждут одного декодирования.
+class ImageCache
+{
+public:
+	using Image = std::shared_ptr<const DecodedImage>;
+
+	explicit ImageCache(size_t capacity) : m_capacity(capacity) {}
+
+	Image Acquire(const std::filesystem::path& path)
+	{
+		std::error_code ec;
+		auto key = std::filesystem::weakly_canonical(path, ec).wstring();
+		if (ec) key = path.wstring();
+		std::ranges::transform(key, key.begin(), [](const wchar_t c) {return static_cast<wchar_t>(std::towlower(c)); });
+
+		auto writeTime = std::filesystem::last_write_time(path, ec);
+		if (ec) return nullptr;
+		auto fileSize = std::filesystem::file_size(path, ec);
+		if (ec) return nullptr;
+
+		std::promise<Image> promise;
+		std::shared_future<Image> inProgress;
+		uint64_t generation = 0;
+		{
+			std::lock_guard lock(m_mutex);
+			auto it = m_index.find(key);
+			if (it != m_index.end()) {
+				auto entry = it->second;
+				if (entry->writeTime == writeTime && entry->fileSize == fileSize) {
+					m_lru.splice(m_lru.begin(), m_lru, entry);
+					return entry->image;
+				}
+				m_used -= entry->bytes;
+				m_lru.erase(entry);
+				m_index.erase(it);
+			}
+
+			auto pending = m_pending.find(key);
+			if (pending != m_pending.end() && pending->second.writeTime == writeTime && pending->second.fileSize == fileSize) {
+				inProgress = pending->second.image;
+			}
+			else {
+				generation = m_nextGeneration++;
+				m_pending[key] = { writeTime, fileSize, generation, promise.get_future().share() };
+			}
+		}
+		if (inProgress.valid()) return inProgress.get();
+
+		// декодируем без блокировки, чтобы запросы к другим образам не ждали
+		auto image = Decode(path);
+
+		{
+			std::lock_guard lock(m_mutex);
+			auto pending = m_pending.find(key);
+			if (pending != m_pending.end() && pending->second.generation == generation)
+				m_pending.erase(pending);
+			if (image) Insert(key, writeTime, fileSize, image);
+		}
+		promise.set_value(image);
+		return image;
+	}
+
+private:
+	struct Entry
+	{
+		std::wstring key;
+		std::filesystem::file_time_type writeTime;
+		uintmax_t fileSize;
+		Image image;
+		size_t bytes;
+	};
+
+	struct Pending
+	{
+		std::filesystem::file_time_type writeTime;
+		uintmax_t fileSize;
+		uint64_t generation;
+		std::shared_future<Image> image;
+	};
+
+	static Image Decode(const std::filesystem::path& path)
+	{
+		try
+		{
+			auto image = std::make_shared<DecodedImage>();
+			ElfReader reader(LogDecodeEvent);
+			if (reader.Decode(path, *image) != 0) return nullptr;
+			return image;
+		}
+		catch (const std::exception& ex)
+		{
+			std::string what = ex.what();
+			std::wstring msg = L"Ошибка!: " + std::wstring(what.begin(), what.end());
+			callback::SendCallback(msg.c_str(), Err, LogDecodeEvent);
+		}
+		catch (...)
+		{
+			callback::SendCallback(L"Неизвестная ошибка!", Err, LogDecodeEvent);
+		}
+		return nullptr;
+	}
+
+	void Insert(const std::wstring& key, std::filesystem::file_time_type writeTime, uintmax_t fileSize, const Image& image)
+	{
+		auto it = m_index.find(key);
+		if (it != m_index.end()) {
+			m_used -= it->second->bytes;
+			m_lru.erase(it->second);
+			m_index.erase(it);
+		}
+		auto bytes = image->Footprint();
+		m_lru.push_front({ key, writeTime, fileSize, image, bytes });
+		m_index[key] = m_lru.begin();
+		m_used += bytes;
+
+		while (m_used > m_capacity && m_lru.size() > 1) {
+			auto& last = m_lru.back();
+			m_used -= last.bytes;
+			m_index.erase(last.key);
+			m_lru.pop_back();
+		}
+	}
+
+	std::mutex m_mutex;
+	std::list<Entry> m_lru;
+	std::unordered_map<std::wstring, std::list<Entry>::iterator> m_index;
+	//образы, которые сейчас декодируются, по тому же ключу
+	std::unordered_map<std::wstring, Pending> m_pending;
+	uint64_t m_nextGeneration = 1;
+	size_t m_capacity;
+	size_t m_used = 0;
+};
+
+class PayloadReader
+{
+public:
+	PayloadReader(const char* data, size_t size) : m_data(data), m_size(size) {}
+
+	bool Ok() const { return m_ok; }
+
+	uint32_t U32() { uint32_t v = 0; Read(&v, sizeof(v)); return v; }
+	uint64_t U64() { uint64_t v = 0; Read(&v, sizeof(v)); return v; }
+
+	std::string Str()
+	{
+		uint16_t len = 0;
+		Read(&len, sizeof(len));
+		if (!m_ok || m_offset + len > m_size) { m_ok = false; return {}; }
+		std::string value(m_data + m_offset, len);
+		m_offset += len;
+		return value;
+	}
+
+private:
+	void Read(void* out, size_t n)
+	{
+		if (!m_ok || m_offset + n > m_size) { m_ok = false; return; }
+		std::memcpy(out, m_data + m_offset, n);
+		m_offset += n;
+	}
+
+	const char* m_data;
+	size_t m_size;
+	size_t m_offset = 0;
+	bool m_ok = true;
+};
+
+class PayloadWriter
+{
+public:
+	void U8(uint8_t v) { Write(&v, sizeof(v)); }
+	void I32(int32_t v) { Write(&v, sizeof(v)); }
+	void U32(uint32_t v) { Write(&v, sizeof(v)); }
+	void U64(uint64_t v) { Write(&v, sizeof(v)); }
+
+	void Str(const std::string& value)
+	{
+		auto len = static_cast<uint16_t>(std::min<size_t>(value.size(), UINT16_MAX));
+		Write(&len, sizeof(len));
+		Write(value.data(), len);
+	}
+
+	void Append(const PayloadWriter& other) { m_buffer += other.m_buffer; }
+
+	const std::string& Data() const { return m_buffer; }
+
+private:
+	void Write(const void* data, size_t n) { m_buffer.append(static_cast<const char*>(data), n); }
+
+	std::string m_buffer;
+};
+
+static std::filesystem::path FromUtf8(const std::string& value)
+{
+	return std::filesystem::path(std::u8string(reinterpret_cast<const char8_t*>(value.data()), value.size()));
+}
+
+static Status HandleRequest(ImageCache& cache, Opcode opcode, PayloadReader& in, PayloadWriter& out)
+{
+	if (opcode == Opcode::Ping) return Status::Ok;
+
+	auto path = in.Str();
+	if (!in.Ok()) return Status::BadRequest;
+
+	auto image = cache.Acquire(FromUtf8(path));
+	if (!image) return Status::LoadFailed;
+
+	switch (opcode)
+	{
+	case Opcode::MemorySizes:
+	{
+		const auto& mem = image->memory;
+		for (auto v : { mem.text, mem.data, mem.bss, mem.flash, mem.ram, mem.binSize, mem.dec })
+			out.I32(v);
+		return Status::Ok;
+	}
+	case Opcode::LineRanges:
+	{
+		auto fileName = in.Str();
+		auto firstLine = in.U32();
+		auto lastLine = in.U32();
+		if (!in.Ok()) return Status::BadRequest;
+
+		auto file = image->FindFile(fileName);
+		if (file == NO_FILE) return Status::NotFound;
+
+		PayloadWriter ranges;
+		uint32_t count = 0;
+		for (auto i : image->LineRows(file, firstLine, lastLine)) {
+			const auto& row = image->rows[i];
+			auto high = image->RowEnd(i);
+			if (high == row.address) continue;
+			ranges.U64(row.address);
+			ranges.U64(high);
+			ranges.U32(row.line);
+			ranges.U32(row.is_stmt ? 1 : 0);
+			++count;
+		}
+		out.U32(count);
+		out.Append(ranges);
+		return Status::Ok;
+	}
+	case Opcode::AddressLookup:
+	{
+		auto count = in.U32();
+		if (!in.Ok() || count > MAX_PAYLOAD / sizeof(uint64_t)) return Status::BadRequest;
+
+		for (uint32_t i = 0; i < count; ++i) {
+			auto address = in.U64();
+			if (!in.Ok()) return Status::BadRequest;
+
+			const auto* row = image->FindRow(address);
+			const auto* func = image->FindFunction(address);
+			out.U32(row ? row->line : 0);
+			out.Str(row ? image->files[row->file] : std::string());
+			out.Str(func ? func->name : std::string());
+			out.U64(func ? func->address : 0);
+		}
+		return Status::Ok;
+	}
+	case Opcode::ResolveBreakpoint:
+	{
+		auto fileName = in.Str();
+		auto line = in.U32();
+		if (!in.Ok()) return Status::BadRequest;
+
+		auto file = image->FindFile(fileName);
+		if (file == NO_FILE) return Status::NotFound;
+
+		std::vector<uint64_t> addresses;
+		auto actual = image->ResolveBreakpoint(file, line, addresses);
+		if (actual == 0) return Status::NotFound;
+
+		out.U32(actual);
+		out.U32(static_cast<uint32_t>(addresses.size()));
+		for (auto address : addresses) out.U64(address);
+		return Status::Ok;
+	}
+	case Opcode::SymbolLookup:
+	{
+		auto name = in.Str();
+		if (!in.Ok()) return Status::BadRequest;
+
+		const auto* sym = image->FindSymbol(name);
+		if (!sym) return Status::NotFound;
+
+		out.U64(sym->address);
+		out.U64(sym->size);
+		out.U8(sym->type);
+		return Status::Ok;
+	}
+	default:
+		return Status::BadRequest;
+	}
+}
+
+static bool RecvAll(SOCKET s, char* data, size_t size)
+{
+	while (size > 0) {
+		int n = recv(s, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)), 0);
+		if (n <= 0) return false;
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+static bool SendAll(SOCKET s, const char* data, size_t size)
+{
+	while (size > 0) {
+		int n = send(s, data, static_cast<int>(std::min<size_t>(size, INT32_MAX)), 0);
+		if (n <= 0) return false;
+		data += n;
+		size -= static_cast<size_t>(n);
+	}
+	return true;
+}
+
+static void ServeClient(SOCKET client, ImageCache& cache)
+{
+	std::vector<char> payload;
+	for (;;)
+	{
+		RequestHeader request{};
+		if (!RecvAll(client, reinterpret_cast<char*>(&request), sizeof(request))) break;
+		if (request.magic != PROTOCOL_MAGIC || request.version != PROTOCOL_VERSION || request.payloadSize > MAX_PAYLOAD) break;
+
+		payload.resize(request.payloadSize);
+		if (!RecvAll(client, payload.data(), payload.size())) break;
+
+		PayloadReader in(payload.data(), payload.size());
+		PayloadWriter out;
+		Status status;
+		try
+		{
+			status = HandleRequest(cache, static_cast<Opcode>(request.opcode), in, out);
+		}
+		catch (...)
+		{
+			status = Status::InternalError;
+		}
+		if (status != Status::Ok) out = PayloadWriter();
+
+		ResponseHeader response{ static_cast<uint32_t>(status), static_cast<uint32_t>(out.Data().size()) };
+		if (!SendAll(client, reinterpret_cast<const char*>(&response), sizeof(response))) break;
+		if (!SendAll(client, out.Data().data(), out.Data().size())) break;
+	}
+	closesocket(client);
+}
+
+// ElfReaderServer [путь к сокету] [лимит кэша, МБ]
+int main(int argc, char** argv)
+{
+	std::string socketPath;
+	if (argc > 1) {
+		socketPath = argv[1];
+	}
+	else {
+		char temp[MAX_PATH] = {};
+		GetTempPathA(MAX_PATH, temp);
+		socketPath = std::string(temp) + "elfreader.sock";
+	}
+	size_t capacityMb = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256;
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		std::wcerr << L"Слишком длинный путь к сокету" << std::endl;
+		return 1;
+	}
+	std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		std::wcerr << L"Не удалось инициализировать Winsock" << std::endl;
+		return 1;
+	}
+
+	SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == INVALID_SOCKET) {
+		std::wcerr << L"Не удалось создать сокет: " << WSAGetLastError() << std::endl;
+		WSACleanup();
+		return 1;
+	}
+
+	DeleteFileA(socketPath.c_str());
+	if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR
+		|| listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+		std::wcerr << L"Не удалось открыть сокет: " << WSAGetLastError() << std::endl;
+		closesocket(listener);
+		WSACleanup();
+		return 1;
+	}
+
+	ImageCache cache(capacityMb * 1024 * 1024);
+	for (;;)
+	{
+		SOCKET client = accept(listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET) break;
+		std::thread(ServeClient, client, std::ref(cache)).detach();
+	}
+
+	closesocket(listener);
+	DeleteFileA(socketPath.c_str());
+	WSACleanup();
+	return 0;
+}
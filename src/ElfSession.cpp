@@ -0,0 +1,43 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <memory>
+
+
+namespace elfreader
+{
+	extern "C" {
+
+		int API_ELF OpenElfSession(const wchar_t* path, callback::build_callback cb, ElfSession** session)
+		{
+			*session = nullptr;
+			try
+			{
+				auto result = std::make_unique<ElfSession>();
+				ElfReader reader(cb);
+				if (reader.Decode(std::filesystem::path(path), result->image) != 0)
+					return 1;
+				*session = result.release();
+				return 0;
+			}
+			catch (const std::exception& ex)
+			{
+				std::wstring msg = L"Ошибка!: ";
+				std::string what = ex.what();
+				std::wstring wwhat(what.begin(), what.end());
+				msg += wwhat;
+				callback::SendCallback(msg.c_str(), Err, cb);
+				return 3;
+			}
+			catch (...)
+			{
+				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
+				return -4;
+			}
+		}
+
+		void API_ELF CloseElfSession(ElfSession* session)
+		{
+			delete session;
+		}
+	}
+}
@@ -0,0 +1,157 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <algorithm>
+#include <memory>
+#include <numeric>
+
+
+namespace elfreader
+{
+	// Один проход по rows: байты [address, следующий адрес последовательности) относятся к файлу строки
+	// и к функциям .symtab, с которыми диапазон пересекается. Без .symtab учитывается весь диапазон.
+	static uint64_t SweepFootprint(const DecodedImage& image, std::vector<uint64_t>& fileBytes, std::vector<uint64_t>& functionBytes)
+	{
+		fileBytes.assign(image.files.size(), 0);
+		functionBytes.assign(image.functions.size(), 0);
+
+		const auto& functions = image.functions;
+		auto start = [&](size_t f) { return image.symbols[functions[f]].address; };
+		auto end = [&](size_t f) { return image.symbols[functions[f]].address + image.symbols[functions[f]].size; };
+
+		uint64_t total = 0;
+		uint64_t previous = 0;
+		size_t f = 0;
+		for (size_t i = 0; i < image.rows.size(); ++i)
+		{
+			const auto& row = image.rows[i];
+			if (row.end_sequence || row.file == NO_FILE) continue;
+			uint64_t lo = row.address;
+			uint64_t hi = image.RowEnd(i);
+			if (hi <= lo) continue;
+
+			if (functions.empty()) {
+				fileBytes[row.file] += hi - lo;
+				total += hi - lo;
+				continue;
+			}
+
+			// последовательности могут пересекаться, тогда ищем функцию заново
+			if (lo < previous) {
+				auto it = std::ranges::upper_bound(functions, lo, {}, [&](uint32_t s) { return image.symbols[s].address; });
+				f = it == functions.begin() ? 0 : static_cast<size_t>(it - functions.begin()) - 1;
+			}
+			previous = lo;
+
+			while (f < functions.size() && end(f) <= lo) ++f;
+			for (size_t g = f; g < functions.size() && start(g) < hi; ++g) {
+				uint64_t a = std::max(lo, start(g));
+				uint64_t b = std::min(hi, end(g));
+				if (a >= b) continue;
+				fileBytes[row.file] += b - a;
+				functionBytes[g] += b - a;
+				total += b - a;
+			}
+		}
+		return total;
+	}
+
+	static std::vector<uint32_t> TopIndices(size_t count, size_t topN, const std::function<uint64_t(uint32_t)>& bytes)
+	{
+		std::vector<uint32_t> order(count);
+		std::iota(order.begin(), order.end(), 0u);
+		size_t n = topN == 0 ? count : std::min(topN, count);
+		std::partial_sort(order.begin(), order.begin() + n, order.end(), [&](uint32_t a, uint32_t b) { return bytes(a) > bytes(b); });
+		order.resize(n);
+		return order;
+	}
+
+	static CFootprint* BuildFootprint(const DecodedImage& image, size_t topN)
+	{
+		std::vector<uint64_t> fileBytes;
+		std::vector<uint64_t> functionBytes;
+		auto total = SweepFootprint(image, fileBytes, functionBytes);
+
+		auto files = TopIndices(fileBytes.size(), topN, [&](uint32_t i) { return fileBytes[i]; });
+		auto functions = TopIndices(functionBytes.size(), topN, [&](uint32_t i) { return image.symbols[image.functions[i]].size; });
+
+		auto result = static_cast<CFootprint*>(std::calloc(1, sizeof(CFootprint)));
+		if (!result) return nullptr;
+		result->totalBytes = total;
+		result->files = static_cast<CFileFootprint*>(std::calloc(std::max<size_t>(files.size(), 1), sizeof(CFileFootprint)));
+		result->functions = static_cast<CFunctionFootprint*>(std::calloc(std::max<size_t>(functions.size(), 1), sizeof(CFunctionFootprint)));
+		if (!result->files || !result->functions) {
+			FreeFootprint(result);
+			return nullptr;
+		}
+
+		for (auto i : files)
+			result->files[result->fileCount++] = { ElfReader::CopyString(image.files[i]), fileBytes[i] };
+
+		for (auto i : functions) {
+			const auto& sym = image.symbols[image.functions[i]];
+			result->functions[result->functionCount++] = { ElfReader::CopyString(sym.name), sym.address, sym.size, functionBytes[i] };
+		}
+		return result;
+	}
+
+	extern "C" {
+
+		int API_ELF SessionFootprint(const ElfSession* session, callback::build_callback cb, size_t topN, CFootprint** footprint)
+		{
+			*footprint = nullptr;
+			if (!session) return 1;
+
+			try
+			{
+				*footprint = BuildFootprint(session->image, topN);
+				if (!*footprint)
+				{
+					callback::SendCallback(L"Ошибка выделения памяти!", Err, cb);
+					return 2;
+				}
+				return 0;
+			}
+			catch (const std::exception& ex)
+			{
+				std::wstring msg = L"Ошибка!: ";
+				std::string what = ex.what();
+				std::wstring wwhat(what.begin(), what.end());
+				msg += wwhat;
+				callback::SendCallback(msg.c_str(), Err, cb);
+				return 3;
+			}
+			catch (...)
+			{
+				callback::SendCallback(L"Неизвестная ошибка!", Err, cb);
+				return -4;
+			}
+		}
+
+		int API_ELF ElfFootprint(const wchar_t* path, callback::build_callback cb, size_t topN, CFootprint** footprint)
+		{
+			*footprint = nullptr;
+
+			ElfSession* session = nullptr;
+			if (auto status = OpenElfSession(path, cb, &session); status != 0) return status;
+			std::unique_ptr<ElfSession, decltype(&CloseElfSession)> guard(session, &CloseElfSession);
+
+			return SessionFootprint(session, cb, topN, footprint);
+		}
+
+		void API_ELF FreeFootprint(CFootprint* footprint)
+		{
+			if (!footprint) return;
+			if (footprint->files) {
+				for (size_t i = 0; i < footprint->fileCount; ++i)
+					if (footprint->files[i].file) std::free(footprint->files[i].file);
+				std::free(footprint->files);
+			}
+			if (footprint->functions) {
+				for (size_t i = 0; i < footprint->functionCount; ++i)
+					if (footprint->functions[i].name) std::free(footprint->functions[i].name);
+				std::free(footprint->functions);
+			}
+			std::free(footprint);
+		}
+	}
+}
@@ -0,0 +1,219 @@
+﻿#include <ElfReader.h>
+#include "DecodedImage.h"
+#include <algorithm>
+
+
+namespace elfreader
+{
+	void StepTable::Build(const DecodedImage& image)
+	{
+		struct Stmt { uint64_t address; uint32_t file; uint32_t line; };
+		std::vector<Stmt> all;
+		for (const auto& row : image.rows)
+			if (row.is_stmt && !row.end_sequence) all.push_back({ row.address, row.file, row.line });
+		// rows уже упорядочены по адресу, если последовательности не пересекаются
+		std::ranges::stable_sort(all, {}, &Stmt::address);
+
+		functions.clear();
+		stmts.clear();
+		nextStmt.clear();
+		lineKeys.clear();
+		exits.clear();
+		exitEnds.clear();
+		exitKeys.clear();
+		functions.reserve(image.functions.size());
+		stmts.reserve(all.size());
+
+		std::vector<std::pair<uint32_t, uint32_t>> keys; // (file, line) начала оператора
+		keys.reserve(all.size());
+		std::vector<std::pair<uint32_t, uint32_t>> exitLines;
+		std::vector<std::pair<uint32_t, uint32_t>> lines;
+
+		size_t k = 0;
+		for (auto index : image.functions)
+		{
+			const auto& sym = image.symbols[index];
+			uint64_t end = sym.address + sym.size;
+			size_t begin = stmts.size();
+
+			while (k < all.size() && all[k].address < sym.address) ++k;
+			for (; k < all.size() && all[k].address < end; ++k) {
+				// на одном адресе действует последняя строка
+				if (stmts.size() > begin && stmts.back() == all[k].address) {
+					keys.back() = { all[k].file, all[k].line };
+					continue;
+				}
+				stmts.push_back(all[k].address);
+				keys.push_back({ all[k].file, all[k].line });
+			}
+
+			size_t count = stmts.size() - begin;
+			nextStmt.resize(stmts.size());
+			for (size_t i = begin + count; i-- > begin;) {
+				if (i + 1 == begin + count) nextStmt[i] = NO_STMT;
+				else if (keys[i + 1] != keys[i]) nextStmt[i] = static_cast<uint32_t>(i + 1);
+				else nextStmt[i] = nextStmt[i + 1];
+			}
+
+			Function fn{ static_cast<uint32_t>(begin), static_cast<uint32_t>(count), static_cast<uint32_t>(exits.size()), 0, false };
+			exitLines.clear();
+			AddExits(image, sym.address, end, fn, exitLines);
+			functions.push_back(fn);
+
+			// ключи строк внутри функции: равны у операторов и выходов одной строки (file, line)
+			lines.assign(keys.begin() + begin, keys.end());
+			lines.insert(lines.end(), exitLines.begin(), exitLines.end());
+			std::ranges::sort(lines);
+			lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+			auto lineKey = [&](const std::pair<uint32_t, uint32_t>& key) {
+				return static_cast<uint32_t>(std::ranges::lower_bound(lines, key) - lines.begin());
+				};
+			for (size_t i = begin; i < stmts.size(); ++i) lineKeys.push_back(lineKey(keys[i]));
+			for (const auto& key : exitLines) exitKeys.push_back(lineKey(key));
+		}
+	}
+
+	void StepTable::AddExits(const DecodedImage& image, uint64_t start, uint64_t end, Function& fn,
+		std::vector<std::pair<uint32_t, uint32_t>>& exitLines)
+	{
+		// Все строки функции, включая не is_stmt: эпилог часто помечен строкой без флага оператора.
+		// На одном адресе действует последняя строка, как в DecodedImage::FindRow.
+		struct Range { uint64_t address; uint64_t end; uint32_t file; uint32_t line; bool epilogue; };
+		std::vector<Range> ranges;
+
+		const auto& rows = image.rows;
+		auto it = std::ranges::upper_bound(rows, start, {}, &LineRow::address);
+		size_t i = it == rows.begin() ? 0 : static_cast<size_t>(it - rows.begin()) - 1;
+		bool epilogue = false;
+		for (; i < rows.size() && rows[i].address < end; ++i) {
+			const auto& row = rows[i];
+			if (row.end_sequence) continue;
+			epilogue |= row.epilogue_begin;
+			if (i + 1 < rows.size() && rows[i + 1].address == row.address && rows[i + 1].sequence == row.sequence) continue;
+			auto high = std::min(image.RowEnd(i), end);
+			if (high > start)
+				ranges.push_back({ std::max(row.address, start), high, row.file, row.line, epilogue });
+			epilogue = false;
+		}
+		if (ranges.empty()) return;
+
+		fn.epilogue = std::ranges::any_of(ranges, &Range::epilogue);
+
+		// без отметок эпилога выходом считается последняя строка основного файла функции:
+		// туда GCC относит эпилог, но это только оценка
+		uint32_t lastFile = ranges.front().file;
+		uint32_t lastLine = 0;
+		if (!fn.epilogue)
+			for (const auto& range : ranges)
+				if (range.file == lastFile) lastLine = std::max(lastLine, range.line);
+
+		for (size_t r = 0; r < ranges.size(); ++r) {
+			bool exit = fn.epilogue ? ranges[r].epilogue : ranges[r].file == lastFile && ranges[r].line == lastLine;
+			bool continues = !fn.epilogue && r > 0 && ranges[r - 1].file == lastFile && ranges[r - 1].line == lastLine
+				&& ranges[r - 1].end == ranges[r].address;
+			if (!exit || continues) continue;
+
+			// участок выхода продолжается, пока подряд идут диапазоны той же строки
+			size_t last = r;
+			while (last + 1 < ranges.size() && ranges[last + 1].address == ranges[last].end
+				&& ranges[last + 1].file == ranges[r].file && ranges[last + 1].line == ranges[r].line && !ranges[last + 1].epilogue)
+				++last;
+			exits.push_back(ranges[r].address);
+			exitEnds.push_back(ranges[last].end);
+			exitLines.push_back({ ranges[r].file, ranges[r].line });
+			++fn.exitCount;
+		}
+	}
+
+	const StepTable& ElfSession::Steps()
+	{
+		std::call_once(m_stepsOnce, [this] { m_steps.Build(image); });
+		return m_steps;
+	}
+
+	// только по отметкам эпилога: оценка выходов не должна выпускать отладчик из функции
+	static bool InEpilogue(const StepTable& steps, const StepTable::Function& fn, uint64_t pc)
+	{
+		if (!fn.epilogue) return false;
+		for (uint32_t i = fn.firstExit; i < fn.firstExit + fn.exitCount; ++i)
+			if (pc >= steps.exits[i] && pc < steps.exitEnds[i]) return true;
+		return false;
+	}
+
+	extern "C" {
+
+		int API_ELF PrepareStepTable(ElfSession* session)
+		{
+			if (!session) return 2;
+			try
+			{
+				session->Steps();
+				return 0;
+			}
+			catch (const std::exception&)
+			{
+				return 3;
+			}
+			catch (...)
+			{
+				return -4;
+			}
+		}
+
+		int API_ELF NextStopAddress(ElfSession* session, uint64_t pc, CStepInfo* info)
+		{
+			if (!session || !info) return 2;
+
+			auto index = session->image.FunctionIndex(pc);
+			if (index == NO_FUNCTION) return 1;
+
+			const auto& steps = session->Steps();
+			const auto& fn = steps.functions[index];
+			const auto& sym = session->image.symbols[session->image.functions[index]];
+			info->functionStart = sym.address;
+			info->functionEnd = sym.address + sym.size;
+
+			auto first = steps.stmts.begin() + fn.firstStmt;
+			auto last = first + fn.stmtCount;
+			auto it = std::upper_bound(first, last, pc);
+
+			//оператор, которому принадлежит pc; в прологе до первого оператора его нет
+			uint32_t current = it == first ? NO_STMT : static_cast<uint32_t>((it - 1) - steps.stmts.begin());
+			uint32_t next = current != NO_STMT ? steps.nextStmt[current] : fn.stmtCount > 0 ? fn.firstStmt : NO_STMT;
+			info->lineKey = current != NO_STMT ? steps.lineKeys[current] : NO_STMT;
+
+			if (InEpilogue(steps, fn, pc)) {
+				// операторы дальше по адресу из эпилога не достижимы
+				info->fallThrough = 0;
+				info->kind = StepFunctionExit;
+			}
+			else {
+				// следующий по адресу оператор - только один из кандидатов: переходы (цикл, ветка if)
+				// приводят к другим операторам функции, их отладчик берёт из GetFunctionSteps
+				info->fallThrough = next != NO_STMT ? steps.stmts[next] : 0;
+				info->kind = StepStatements;
+			}
+			return 0;
+		}
+
+		int API_ELF GetFunctionSteps(ElfSession* session, uint64_t pc,
+			const uint64_t** stmts, const uint32_t** stmtKeys, size_t* stmtCount,
+			const uint64_t** exits, const uint32_t** exitKeys, size_t* exitCount)
+		{
+			if (!session || !stmts || !stmtKeys || !stmtCount || !exits || !exitKeys || !exitCount) return 2;
+
+			auto index = session->image.FunctionIndex(pc);
+			if (index == NO_FUNCTION) return 1;
+
+			const auto& steps = session->Steps();
+			const auto& fn = steps.functions[index];
+			*stmts = steps.stmts.data() + fn.firstStmt;
+			*stmtKeys = steps.lineKeys.data() + fn.firstStmt;
+			*stmtCount = fn.stmtCount;
+			*exits = steps.exits.data() + fn.firstExit;
+			*exitKeys = steps.exitKeys.data() + fn.firstExit;
+			*exitCount = fn.exitCount;
+			return 0;
+		}
+	}
+}